@@ -0,0 +1,48 @@
+10 REM Benchmark: array statements against FOR loops doing the same work
+20 REM Each subroutine times both ways and prints the seconds taken
+30 GOSUB 1000
+40 GOSUB 2000
+90 END
+1000 REM SUBROUTINE matrix product C = A * B
+1004 REM P products by FOR loops, R products by MAT
+1010 LET N = 50: LET P = 20: LET R = 50000
+1020 DIM A(N,N), B(N,N), C(N,N)
+1030 FOR I = 1 TO N: FOR J = 1 TO N
+1040 LET A(I,J) = RND: LET B(I,J) = RND
+1050 NEXT J: NEXT I
+1060 LET T = TIME
+1070 FOR H = 1 TO P
+1080 FOR I = 1 TO N: FOR J = 1 TO N
+1090 LET S = 0
+1100 FOR K = 1 TO N: LET S = S + A(I,K) * B(K,J): NEXT K
+1110 LET C(I,J) = S
+1120 NEXT J: NEXT I
+1130 NEXT H
+1140 LET T1 = TIME - T
+1150 LET T = TIME
+1160 FOR H = 1 TO R: MAT C = A * B: NEXT H
+1170 LET T2 = TIME - T
+1180 PRINT "MATRIX PRODUCT BY FOR LOOPS: "; P; " IN "; T1; " SECONDS"
+1190 PRINT "MATRIX PRODUCT BY MAT: "; R; " IN "; T2; " SECONDS"
+1200 RETURN
+2000 REM SUBROUTINE update Y = Y + K * X and dot product of X and Y
+2004 REM P repetitions by FOR loops, R repetitions by whole arrays
+2010 LET N = 1000: LET P = 2000: LET R = 500000: LET K = 0.001
+2020 DIM X(N), Y(N)
+2030 FOR I = 1 TO N: LET X(I) = RND: NEXT I
+2040 LET T = TIME
+2050 FOR H = 1 TO P
+2060 FOR I = 1 TO N: LET Y(I) = Y(I) + K * X(I): NEXT I
+2070 LET S = 0
+2080 FOR I = 1 TO N: LET S = S + X(I) * Y(I): NEXT I
+2090 NEXT H
+2100 LET T1 = TIME - T
+2110 LET T = TIME
+2120 FOR H = 1 TO R
+2130 LET Y() = Y() + K * X()
+2140 LET S = DOT(X, Y)
+2150 NEXT H
+2160 LET T2 = TIME - T
+2170 PRINT "UPDATE AND DOT BY FOR LOOPS: "; P; " IN "; T1; " SECONDS"
+2180 PRINT "UPDATE AND DOT BY ARRAYS: "; R; " IN "; T2; " SECONDS"
+2190 RETURN
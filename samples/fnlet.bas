@@ -0,0 +1,20 @@
+10 REM New variables assigned the values of functions with parameters
+20 DEF FNF(X) = EXP(-X^2)
+30 DEF REP$(A$, N)
+40   LOCAL I, R$
+50   FOR I = 1 TO N: LET R$ = R$ + A$: NEXT I
+60   RETURN R$
+70 FNEND
+80 DEF GROW(N)
+90   LET G$ = G$ + REP$("*", N)
+100   LET H = N
+110   RETURN N * 2
+120 FNEND
+130 LET X = 0.5
+140 LET Y = FNF(X)
+150 PRINT X, Y
+160 LET S$ = REP$("AB", 3), Z = FNF(0) + FNF(Y)
+170 PRINT S$, Z
+180 LET G$ = ""
+190 LET W = GROW(40) + GROW(3)
+200 PRINT W, H, LEN(G$)
@@ -1,2 +1,2 @@
 # clang -Wno-pointer-sign -O2 -lm -o straybasic straybasic.c
-clang -O1 -Wno-pointer-sign -lm -o straybasic straybasic.c
\ No newline at end of file
+clang -O1 -Wno-pointer-sign -lm -pthread -o straybasic straybasic.c
\ No newline at end of file
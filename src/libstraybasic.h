@@ -0,0 +1,69 @@
+/// \file libstraybasic.h
+/// \author Paolo Caressa <github.com/pcaressa>
+/// \date 20261018
+
+/** Interface of the StrayBasic library, obtained by compiling straybasic.c
+    with the macro SB_LIBRARY defined, which leaves out the main program.
+
+    A host program creates interpreters by sb_new: each one has its own
+    program, variables and files, so that different interpreters can run
+    at the same time on different threads, while an interpreter should be
+    used by one thread at a time. Functions returning an int return 0 or the
+    code of the error raised, whose message is returned by sb_message: the
+    codes are the SB_ constants below. */
+
+#ifndef LIBSTRAYBASIC_H
+#define LIBSTRAYBASIC_H
+
+#include <sys/types.h>
+
+/// Error codes: same ordering as in straybasic.h.
+enum {
+#   define E(code, message) SB_##code,
+#   include "straybasic.h"
+};
+
+/// An interpreter.
+typedef struct runtime sb_t;
+
+/** Callbacks which read into buf up to size characters for channel #0,
+    returning how many were read (0 at the end of the input), and write the
+    size characters at buf printed on channel #0, returning how many were
+    written: user is the pointer given to sb_io. */
+typedef ssize_t sb_read_t(void *user, char *buf, size_t size);
+typedef ssize_t sb_write_t(void *user, const char *buf, size_t size);
+
+/** Create a new interpreter, with no program, reading from stdin and writing
+    on stdout: return NULL if there is no memory for it. */
+sb_t *sb_new(void);
+
+/// Close the files of the interpreter sb and free it.
+void sb_free(sb_t *sb);
+
+/** Let the interpreter sb read and write channel #0 by the callbacks read and
+    write: if read is NULL there is no input, if write is NULL the output is
+    discarded. Messages and listings are written by write, too. */
+int sb_io(sb_t *sb, sb_read_t *read, sb_write_t *write, void *user);
+
+/** Replace the program of sb with the lines of source, separated by newlines,
+    as LOAD does: lines without a number are executed at once. */
+int sb_load(sb_t *sb, const char *source);
+
+/** Run the program of sb, as RUN does, but keeping the variables: if budget
+    > 0, the program is stopped by a SB_BUDGET error after executing budget
+    statements. Return the error which stopped the program, if any. */
+int sb_run(sb_t *sb, long budget);
+
+/** Get or set the numerical variable or the string variable (whose name ends
+    with "$") of sb named name, in any case: variables are created if they
+    are set, and are kept by sb_run. The string returned by sb_get_str is
+    valid until sb is used again. */
+int sb_get_num(sb_t *sb, const char *name, double *x);
+int sb_set_num(sb_t *sb, const char *name, double x);
+int sb_get_str(sb_t *sb, const char *name, const char **s);
+int sb_set_str(sb_t *sb, const char *name, const char *s);
+
+/// Return the message of the error code error, or NULL if it has none.
+const char *sb_message(int error);
+
+#endif
@@ -2,17 +2,16 @@
 /// \author Paolo Caressa <github.com/pcaressa>
 /// \date 20250228
 /// \todo Assign substrings as in LET X$(2 TO 3) = ...
-/// \todo Calling external programs.
-/// \todo MAT instructions
-/// \todo More functions, such as SPACE$(n), etc.
-/// \todo Multiple line DEF FNs.
 
 #define VERSION "STRAYBASIC 1.0"
 
+#define _GNU_SOURCE     // fopencookie is needed by output channels.
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -20,35 +19,84 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
 
 /// \defgroup CONSTANTS Global Constants
 /// \{
 
-#define BUF_NUM (4)         ///< Number of file buffer (included stdin/out).
 #define BUF_SIZE (256)      ///< Total length of a file buffer.
+#define CHAN_NUM (5)        ///< Initial size of the channel table.
+#define CHAN_MAX (65536)    ///< Max number of channels, if not set by the OS.
 #define CSTR_SIZE (4096)    ///< Size of string area.
-#define ESTACK_SIZE (20)    ///< Numbers of items in the expression-stack.
+#define ESTACK_SIZE (1024)  ///< Numbers of items in the expression-stack.
 #define LINE_MIN (1)        ///< Minimum line number.
 #define LINE_MAX (9999)     ///< Maximum line number.
+#define OUT_BUF_SIZE (65536)///< Size of stdout buffer in batch mode.
+#define KBD_SIZE (64)       ///< Size of the keyboard queue.
 #define PROG_SIZE (8192)    ///< Size of program area.
 #define RAM_SIZE (65536)    ///< Total RAM size, <= 65536.
 #define RSTACK_SIZE (60)    ///< Numbers of items in the return-stack.
-#define STACK_SIZE (120)    ///< Numbers of items in the stack.
+#define STACK_SIZE (2048)   ///< Numbers of items in the stack.
+#define TAB_SIZE (16)       ///< Tabulation interval in PRINT lists.
+#define WB_SIZE (1 << 22)   ///< Size of each buffer of an output file.
+#define RA_SIZE (1 << 20)   ///< Size of each block read ahead from a file.
+#define RA_BLOCKS (4)       ///< Number of blocks read ahead from a file.
+#define MAT_COLS (16)       ///< Max number of arrays in MAT INPUT/PRINT.
+#define STR_FIELD (32)      ///< Default width of a string in a binary record.
+#define MAT_BLOCK (64)      ///< Side of the blocks of a matrix product.
+#define ARRAY_ARGS (255)    ///< Arity of the operators on whole arrays.
+#define VAR_ALIGN (16)      ///< Alignment of variables and numerical items.
+#define VAR_HEAD (8)        ///< Size, name and type fields of a variable.
+#define MAP_SLOTS (8)       ///< Initial number of slots of a map.
+#define PAT_ATOMS (64)      ///< Max positions in a compiled pattern.
+#define PAT_STATES (64)     ///< Max states of the DFA of a pattern.
+#define PAT_CACHE (8)       ///< Number of compiled patterns kept.
+#ifndef FN_DEPTH
+#define FN_DEPTH (256)      ///< Max number of nested function calls.
+#endif
+#define FN_MEMO (256)       ///< Results kept for each PURE function.
+#define FN_MEMO_ARGS (4)    ///< Max number of parameters of a PURE function.
+#define PAR_CHUNKS (256)    ///< Max chunks a PARALLEL FOR is split into.
+#define PAR_REDUCE (8)      ///< Max variables reduced by a PARALLEL FOR.
+#define PAR_THREADS (64)    ///< Max worker threads running PARALLEL FORs.
+#define SERVE_POOL (8)      ///< Children waiting for jobs in server mode.
+#define SERVE_BUDGET (100000000L)   ///< Max statements executed by a job.
+#define SERVE_TIME (60)     ///< Max seconds a job may last.
+#define CKPT_FILE "straybasic.ckp"  ///< Checkpoint file if none was named.
+#define CKPT_MAGIC "STRAYBASIC CKP1"///< First bytes of a checkpoint file.
+#define VAR_ALIGNED(a) (((a) + VAR_ALIGN - 1) & -VAR_ALIGN) ///< Round up a.
 
 /** Token codes: keyword and operator codes are in the same ordering as the
     corresponding items in the Operators and Instructions tables are. */
 enum {
     CODE_INTLIT = 128, CODE_NUMLIT, CODE_STRLIT, CODE_IDN, CODE_IDNS,
-    CODE_STARTKEYWORD,  // Fake code, used as delimiter
+    CODE_STARTKEYWORD = CODE_IDNS,  // Delimiter: keywords follow it
 #   define I(name) CODE_##name,
 #   include "straybasic.h"
     CODE_ENDKEYWORD,    // Fake code, used as delimiter
-    CODE_STARTOPERATOR, // Fake code, used as delimiter
+    CODE_STARTOPERATOR = CODE_ENDKEYWORD - 1,   // Delimiter: operators follow it
 #   define O(name, label, arity, isinfix, priority) CODE_##label,
 #   include "straybasic.h"
     CODE_ENDOPERATOR,   // Fake code, used as delimiter
 };
 
+// Token codes are stored in single bytes.
+_Static_assert(CODE_ENDOPERATOR <= 256, "TOO MANY KEYWORDS AND OPERATORS");
+
 /** Keywords, in the same ordering as the constant between CODE_STARTKEYWORD and
     CODE_ENDKEYWORD and items in Instructions[] are. */
 const char *Keywords[] = {
@@ -72,7 +120,15 @@ const char *Errors[] = {
 /// Variable types: they are bits in a byte, so & and | apply.
 enum {
     VAR_NONE = 0, VAR_CHR = 1, VAR_NUM = 2, VAR_STR = 4, VAR_FOR = 8,
-    VAR_VEC = 16, VAR_MAT = 32
+    VAR_VEC = 16, VAR_MAT = 32, VAR_MAP = 64
+};
+
+/** Screen attributes, as set by ATTR: they are bits in a word, but FORE and
+    BACK which are 3 bits rgb colours. */
+enum {
+    ATTR_FORE = 7, ATTR_BACK = 7 << 3, ATTR_BOLD = 64, ATTR_BLINK = 128,
+    ATTR_BRIGHT = 256, ATTR_REVERSE = 512, ATTR_UNDER = 1024,
+    ATTR_DEFAULT = 2 | ATTR_BRIGHT  // Green on black.
 };
 
 /// \}
@@ -86,15 +142,73 @@ typedef float num_t;        ///< Number.
 
 #define NIL (0xFFFF)        ///< Used as NULL address for strings.
 
+/// A character on the screen buffer, along with its attributes.
+typedef struct { byte_t ch; uint16_t attr; } cell_t;
+
+/** An I/O channel: file is NULL if the channel is free. Input files which are
+    regular files are mapped in memory, and read from map[pos:size] instead
+    of from file, while other ones are read by lines into buf; output files
+    are written by a background thread which drains the buffers in wb, and
+    files opened in read-ahead mode are read by a thread which fills ra.
+    Binary files have records of reclen bytes, and pos is the index of the
+    next record to access. Pipes are connected to process pid. The name and
+    the mode given to OPEN are kept, so that CHECKPOINT can record them. */
+typedef struct {
+    FILE *file;
+    char *buf;
+    char *map; size_t pos, size;
+    struct wbuf *wb;
+    struct rbuf *ra;
+    int reclen;
+    pid_t pid;
+    unsigned long bytes, lines;     ///< Data read or written so far.
+    char *name;
+    int mode;
+} chan_t;
+
+/** A running call of a user defined function: ip0 and ip point to the call,
+    rsp, sp, tsp, estack_next and vec_used are the stacks and temporaries
+    at the call, the statements of the function reset them to, bind is the
+    index of its first local variable in rt.bind, type is CODE_IDN or
+    CODE_IDNS according to its value, and returned is set by RETURN or FNEND,
+    when the value of the function is on the stack. */
+typedef struct {
+    addr_t ip0, ip, rsp, sp, tsp;
+    int estack_next, bind, type, returned;
+    size_t vec_used;
+} frame_t;
+
+/** A local variable of a running function, named name, at address addr:
+    prev is the index in rt.bind of the variable it hides, or -1. */
+typedef struct { str_t name; addr_t addr; int prev; } bind_t;
+
+/** A result of a PURE function, for the arguments arg (unused ones are 0):
+    used is 0 if the slot is empty. */
+typedef struct { num_t arg[FN_MEMO_ARGS], value; int used; } memo_t;
+
+/** A user defined function found in the program: ip0 and ip point to its DEF
+    line and to what follows its name there. If it was declared PURE, then its
+    last results are kept in memo, and hits and misses count the calls whose
+    result was found there or not. */
+typedef struct {
+    str_t name;
+    addr_t ip0, ip;
+    memo_t *memo;
+    int pure;
+    unsigned long hits, misses;
+} fn_t;
+
 /// \}
 /// \defgroup RUNTIME Runtime Class
 /// \{
 
-/** Object contain global variables, rt means "runtime". */
-struct {
+/** Object contain global variables, rt means "runtime": there is one for
+    each interpreter created by sb_new, or by main, and one for each thread
+    running the body of a PARALLEL FOR. */
+struct runtime {
     /** All stuff (constants, programs, variables, stacks, buffers) are stored
         in a 16-bit addressable RAM memory. */
-    byte_t ram[RAM_SIZE];
+    _Alignas(VAR_ALIGN) byte_t ram[RAM_SIZE];
 
     addr_t csp0;    ///< RAM[csp0:csp] contains string constants.
     addr_t csp;     ///< RAM[csp0:csp] contains string constants.
@@ -103,6 +217,7 @@ struct {
     addr_t pp;      ///< RAM[pp0:pp] contains the program.
     addr_t vp0;     ///< RAM[vp0:vp] contains the variables list.
     addr_t vp;      ///< RAM[vp0:vp] contains the variables list.
+    addr_t hidden;  ///< New variable at vp hidden by LET, or NIL.
     addr_t sp0;     ///< RAM[sp0:sp] contains the parameters stack.
     addr_t sp;      ///< RAM[sp0:sp] contains the parameters stack.
     addr_t rsp0;    ///< RAM[rsp0:rsp] contains the return stack.
@@ -112,16 +227,22 @@ struct {
         before being inserted in the program or executed. */
     addr_t obj;
     
-    /// File buffers: buf[0] is reserved to the terminal.
-    addr_t buf[1 + BUF_NUM];
+    /// Terminal buffer, where source lines are read, too.
+    addr_t buf;
 
-    /** I/O files: channels[0] is always stdin or stdout, while channels[i]
-       from i = 1 to BUF_NUM are NULL or handles to opened text files. */
-    FILE *channels[1 + BUF_NUM];
+    /** I/O channels: chan[0].file is always stdin or stdout, while chan[i]
+        from i = 1 to chan_num - 1 are free or opened files. The table is
+        allocated outside the RAM and grows up to chan_max channels, that
+        is the limit of open files allowed by the OS. */
+    chan_t *chan;
+    int chan_num;
+    int chan_max;
 
     addr_t ip0;         ///< First byte of the current line (its size byte).
     addr_t ip;          ///< First byte of next token in the current line.
     addr_t data_next;   ///< Address of item in a DATA statement to READ from.
+    int num;            ///< Rows transferred by the last MAT INPUT or PRINT.
+    int status;         ///< Exit status of the last SYS or pipe closed.
 
     jmp_buf err_buffer; ///< Exception handler.
 
@@ -132,14 +253,89 @@ struct {
     addr_t on_error;    ///< If != NIL, instruction where to jump on error.
     int prog_changed;   ///< 1 if the program was not saved since last changes.
     int trace;          ///< 1 if runnig the program lines are printed.
+    int batch;          /**< 1 if running headless: no escape sequences are
+                            sent to the terminal, stdout is fully buffered. */
+    /** Virtual terminal: position of the cursor (from 1) and size of the
+        terminal, maintained by the TERM routines, so that no query to the
+        terminal is ever needed. */
+    struct { int row, col, width, height; } term;
+    int attr;           ///< Current screen attributes, as set by ATTR.
+
+    /** Screen buffer: if screen[0] != NULL, then PRINT writes into the screen
+        buffer screen[0] which is sent to the terminal by REFRESH; screen[1]
+        contains what is on the terminal, while rows*cols is the size of both
+        buffers (which may differ from the terminal size if it was resized). */
+    cell_t *screen[2];
+    int rows, cols;
+
+    /** Keyboard: while raw != 0 the terminal is in non canonical mode and
+        saved contains its previous settings; pressed keys are collected in
+        the circular queue[head:tail], eof is set when stdin is ended. */
+    struct {
+        struct termios saved;
+        int raw, eof, head, tail;
+        byte_t queue[KBD_SIZE];
+    } kbd;
 
     /** Operator stack: contains operator with priorities lower than the one
         under execution, inside an expression. */
     struct { void (*routine)(void); int priority; } estack[ESTACK_SIZE];
     int estack_next;    ///< 0 it means "stack empty".
+
+    /** Temporary arrays of a whole-array expression: they are allocated
+        outside the RAM, vec[0:vec_used] are in use out of vec_size. */
+    num_t *vec;
+    size_t vec_used, vec_size;
+
+    /** Compiled patterns used by MATCH, allocated outside the RAM: when a
+        new one is needed the least recently used, by pat_tick, is replaced. */
+    struct pat *pat[PAT_CACHE];
+    unsigned long pat_tick;
+
+    /** Calls of user defined functions, allocated outside the RAM: frame[0:
+        fn_depth] are running and bind[0:bind_num] are their local variables,
+        while local[s] is 1 + the index in bind of the innermost one named s,
+        or 0, so that local variables are found without searching. */
+    frame_t *frame;
+    int fn_depth, frame_size;
+    bind_t *bind;
+    int bind_num, bind_size;
+    int *local;
+
+    /** User defined functions found so far, allocated outside the RAM: they
+        are forgotten when the program changes or is run. */
+    fn_t *fn;
+    int fn_num, fn_size;
+
+    /** PARALLEL FOR: par is the pool of worker threads, created when first
+        needed, while parallel is 1 in the copies of rt used by the workers,
+        where seed is the state of the RND generator. */
+    struct par *par;
+    int parallel;
+    unsigned seed;
+
+    /** Embedding: hosted is 1 if the interpreter was created by sb_new, so
+        that it never asks the user nor exits the process, and RND uses seed;
+        in, out and msg replace stdin, stdout and stderr; if budget > 0 it is
+        the number of statements the program may still execute, while fault is
+        the error which stopped the last run, if any. */
+    int hosted;
+    FILE *in, *out, *msg;
+    long budget;
+    int fault;
+
+    /** Checkpoints: ckpt is the file named by the last CHECKPOINT, where the
+        checkpoint asked by SIGUSR1, which sets ckpt_signal, is written too. */
+    char ckpt[BUF_SIZE];
+    volatile sig_atomic_t ckpt_signal;
     
     time_t t0;          ///< Interpreter launch time.
-} rt;
+};
+
+/** The runtime of the interpreter running on the calling thread: it is set by
+    main, by the sb_ functions and by the workers of a PARALLEL FOR. */
+_Thread_local struct runtime *rt_current;
+#define rt (*rt_current)
 
 //  Common shortcuts: assume the rt_t variable rt to be defined.
 #define IP (rt.ip)
@@ -148,28 +344,68 @@ struct {
 #define ERROR(e) longjmp(rt.err_buffer, rt.error = (ERROR_##e));
 #define EXPECT(tok, msg) if (RAM[IP++] != tok) ERROR(msg)
 
-#include <termios.h>
-#include <unistd.h>
-///  Get pressed key: Linux specific!
-char rt_inkey(void) {
-    static struct termios term;
-    tcgetattr(STDIN_FILENO, &term);
-    // Save c_lflags.
-    tcflag_t c_lflag_saved = term.c_lflag;
-    int vmin_saved = term.c_cc[VMIN];
-    int vtime_saved = term.c_cc[VTIME];
-    // No waiting mode, no echo, ignore break.
-    term.c_lflag &= ~(ICANON | ECHO | ISIG);
+/** Restore the terminal settings changed by kbd_raw: this is done when the
+    program ends or needs a canonical input, and at exit. */
+void kbd_restore(void) {
+    if (rt.kbd.raw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &rt.kbd.saved);
+        rt.kbd.raw = 0;
+}}
+
+/** If stdin is a terminal, put it in non canonical mode without echo, so
+    that keys can be read as soon as they are pressed: the terminal remains
+    in this mode until kbd_restore is called. Linux specific! The terminal of
+    a host program is never changed. */
+void kbd_raw(void) {
+    static int registered = 0;
+    if (rt.kbd.raw || rt.hosted || !isatty(STDIN_FILENO)) return;
+    if (!registered) registered = atexit(kbd_restore) == 0;
+    struct termios term;
+    tcgetattr(STDIN_FILENO, &rt.kbd.saved);
+    term = rt.kbd.saved;
+    term.c_lflag &= ~(ICANON | ECHO);
     term.c_cc[VMIN] = 0;
     term.c_cc[VTIME] = 0;
-    tcsetattr(0, TCSANOW, &term);
-    char ch = '\0';
-    read(STDIN_FILENO, &ch, 1);
-    term.c_lflag = c_lflag_saved;
-    term.c_cc[VMIN] = vmin_saved;
-    term.c_cc[VTIME] = vtime_saved;
     tcsetattr(STDIN_FILENO, TCSANOW, &term);
-    return ch;
+    rt.kbd.raw = 1;
+}
+
+/** Move into the queue the keys available on rt.in: if none is available,
+    wait up to timeout milliseconds (forever if timeout < 0). */
+void kbd_fill(int timeout) {
+    int fd = fileno(rt.in);
+    if (rt.kbd.eof) return;
+    if (fd < 0) {
+        // The callbacks of a host cannot be polled: keys are read if waited.
+        int c = timeout == 0 ? 0 : getc(rt.in);
+        if (c == EOF) rt.kbd.eof = 1;
+        else if (timeout != 0) {
+            rt.kbd.queue[rt.kbd.tail] = c;
+            rt.kbd.tail = (rt.kbd.tail + 1) % KBD_SIZE;
+        }
+        return;
+    }
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout) <= 0) return;
+    byte_t b[KBD_SIZE];
+    int free = (rt.kbd.head - rt.kbd.tail - 1 + KBD_SIZE) % KBD_SIZE;
+    int n = read(fd, b, free);
+    if (n == 0) rt.kbd.eof = 1;
+    for (int i = 0; i < n; ++ i) {
+        rt.kbd.queue[rt.kbd.tail] = b[i];
+        rt.kbd.tail = (rt.kbd.tail + 1) % KBD_SIZE;
+}}
+
+/** Return the first key in the queue, 0 if none is available: if wait != 0
+    then wait for a key to be pressed, unless stdin is ended. */
+int kbd_get(int wait) {
+    kbd_raw();
+    if (rt.kbd.head == rt.kbd.tail) kbd_fill(0);
+    while (wait && rt.kbd.head == rt.kbd.tail && !rt.kbd.eof) kbd_fill(-1);
+    if (rt.kbd.head == rt.kbd.tail) return 0;
+    int c = rt.kbd.queue[rt.kbd.head];
+    rt.kbd.head = (rt.kbd.head + 1) % KBD_SIZE;
+    return c;
 }
 
 void rt_ctrlbreak(int sig) {
@@ -178,18 +414,23 @@ void rt_ctrlbreak(int sig) {
     else if (sig == SIGINT) ERROR(BREAK);
 }
 
+/** SIGUSR1 handler: a checkpoint is taken before the next statement of the
+    program, outside of functions. */
+void rt_checkpoint(int sig) {
+    rt.ckpt_signal = 1;
+}
+
 /** Initialize a virtual ram. */
 void rt_init(void) {
+    extern void term_home(void), term_size(int);
     // Memory area limits, always set
     rt.csp0 = 0;
     rt.pp0 = rt.csp0 + CSTR_SIZE;
     rt.vp0 = rt.pp0 + PROG_SIZE;
     
-    // Upper part of the memory contains 256-sized buffers.
-    rt.buf[BUF_NUM] = RAM_SIZE - BUF_SIZE;
-    for (int i = BUF_NUM - 1; i >= 0; -- i)
-        rt.buf[i] = rt.buf[i+1] - BUF_SIZE;
-    rt.obj = rt.buf[0] - BUF_SIZE;
+    // Upper part of the memory contains the 256-sized terminal buffer.
+    rt.buf = RAM_SIZE - BUF_SIZE;
+    rt.obj = rt.buf - BUF_SIZE;
     rt.rsp0 = rt.obj - RSTACK_SIZE;
     rt.sp0 = rt.rsp0 - STACK_SIZE;
 
@@ -201,6 +442,12 @@ void rt_init(void) {
     rt.err = 0;
     rt.on_error = NIL;
     rt.trace = 0;
+    rt.in = stdin;
+    rt.out = stdout;
+    rt.msg = stderr;
+    term_home();
+    term_size(0);
+    rt.attr = ATTR_DEFAULT;
 
     // Reset data pointer: points to the first token of the first line.
     rt.data_next = rt.pp0 + 2 + sizeof(addr_t);
@@ -212,13 +459,27 @@ void rt_init(void) {
     rt.tsp = rt.csp = rt.csp0;
     rt.pp = rt.pp0;
     rt.prog_changed = 0;
-    for (int i = 0; i < 1 + BUF_NUM; ++ i)
-        rt.channels[i] = NULL;
+    struct rlimit nofile;
+    rt.chan_max = CHAN_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < CHAN_MAX)
+        rt.chan_max = nofile.rlim_cur;
+    rt.chan_num = CHAN_NUM;
+    rt.chan = calloc(rt.chan_num, sizeof(chan_t));
+    assert(rt.chan != NULL);
 
     // Set the initial time.
     rt.t0 = time(NULL);
+}
 
-    signal(SIGINT, rt_ctrlbreak);
+/** Allocate and initialize a new runtime, which becomes the current one:
+    return NULL if there is no memory for it. */
+struct runtime *rt_new(void) {
+    struct runtime *r = calloc(1, sizeof(struct runtime));
+    if (r != NULL) {
+        rt_current = r;
+        rt_init();
+    }
+    return r;
 }
 
 /// Constants used as parameters in the rt_reset() function.
@@ -229,6 +490,18 @@ enum {
     RT_RESET_ALL = 255
 };
 
+/// Forget all local variables and running functions.
+void rt_unbind(void) {
+    while (rt.bind_num > 0) rt.local[rt.bind[-- rt.bind_num].name] = 0;
+    rt.fn_depth = 0;
+}
+
+/** Forget the user defined functions found so far, and their results: they
+    will be looked for in the program again. */
+void rt_forget(void) {
+    while (rt.fn_num > 0) free(rt.fn[-- rt.fn_num].memo);
+}
+
 /** Reset the virtual machine: according to the value of flags, reset the
     corresponding item. */
 void rt_reset(int flags) {
@@ -240,6 +513,8 @@ void rt_reset(int flags) {
         rt.data_next = rt.pp0 + 2 + sizeof(addr_t);
         rt.vp = rt.vp0;     // Drop all variables.
         rt.rsp = rt.rsp0;   // Reset return stack.
+        rt_unbind();
+        rt_forget();
     }
     if (flags & RT_RESET_PROG) {
         rt.pp = rt.pp0;
@@ -249,15 +524,24 @@ void rt_reset(int flags) {
         flags |= RT_RESET_FILES;
     }
     if (flags & RT_RESET_FILES) {
-        for (int i = 1; i <= BUF_NUM; ++ i) {
-            if (rt.channels[i] != NULL) {
-                fclose(rt.channels[i]);
-                rt.channels[i] = NULL;
-    }}}
+        extern int chan_close(int);
+        for (int i = 1; i < rt.chan_num; ++ i) {
+            if (rt.chan[i].file != NULL) chan_close(i);
+    }}
     // Some globals are always reset.
     rt.estack_next = 0; // Reset operator stack.
+    rt.vec_used = 0;    // Drop temporary arrays.
     rt.sp = rt.sp0;     // Reset operand stack.
+    rt.hidden = NIL;    // No LET is running.
     rt.tsp = rt.csp;    // Reset temporary string area.
+    if (rt.fn_depth > 0) {
+        // Inside a function, keep what its caller is using.
+        frame_t *f = rt.frame + rt.fn_depth - 1;
+        rt.estack_next = f->estack_next;
+        rt.vec_used = f->vec_used;
+        rt.sp = f->sp;
+        rt.tsp = f->tsp;
+    }
     rt.error = 0;       // Reset the error status.
     rt.err = 0;         // Reset the err status.
 }
@@ -279,14 +563,242 @@ void rt_epop(int p) {
         (*rt.estack[--rt.estack_next].routine)();
 }
 
+/** Return rt.msg, after writing what is pending on rt.out: in batch mode the
+    latter is fully buffered, and messages would precede the output. */
+FILE *rt_msg(void) {
+    if (rt.msg != rt.out) fflush(rt.out);
+    return rt.msg;
+}
+
+/** Return a pseudo-random number from 0 to RAND_MAX: the workers of a
+    PARALLEL FOR and hosted interpreters draw it from their own seed. */
+int rt_rand(void) {
+    return rt.parallel || rt.hosted ? rand_r(&rt.seed) : rand();
+}
+
+/// Set the seed of the numbers returned by rt_rand.
+void rt_srand(unsigned seed) {
+    if (rt.hosted) rt.seed = seed; else srand(seed);
+}
+
+/// \}
+/** \defgroup TERM Terminal Output
+
+    Whatever is printed on channel #0 passes through these routines, which
+    keep the virtual terminal rt.term up to date: the cursor position is
+    tracked by looking at the printed characters, while the terminal size is
+    asked to the OS at startup and any time a SIGWINCH signal is received.
+    Thus tabulations and positioning are computed without querying the
+    terminal. In batch mode (stdout is not a terminal or the -b switch was
+    given) no escape sequence is ever emitted and stdout is fully buffered,
+    being flushed only on INPUT and at exit. */
+/// \{
+
+/** Retrieve the terminal size: it is also the SIGWINCH handler. If the size
+    cannot be asked to the OS, then the environment variables COLUMNS and
+    LINES are used, if any, else a 80x24 terminal is assumed. */
+void term_size(int sig) {
+    struct winsize ws;
+    if (ioctl(fileno(rt.out), TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        rt.term.width = ws.ws_col;
+        rt.term.height = ws.ws_row;
+    } else if (sig == 0) {
+        char *w = getenv("COLUMNS"), *h = getenv("LINES");
+        rt.term.width = w != NULL ? atoi(w) : 80;
+        rt.term.height = h != NULL ? atoi(h) : 24;
+    }
+    if (rt.term.width < 1) rt.term.width = 80;
+    if (rt.term.height < 1) rt.term.height = 24;
+}
+
+/// Set the cursor position to the top-left corner.
+void term_home(void) { rt.term.row = rt.term.col = 1; }
+
+/// Fill n cells from c with blanks of the current attribute.
+void term_blank(cell_t *c, int n) {
+    while (n-- > 0) { c->ch = ' '; c->attr = rt.attr; ++ c; }
+}
+
+/// The cursor goes to the next line, as when the user hits RETURN.
+void term_newline(void) {
+    rt.term.col = 1;
+    if (rt.term.row < rt.term.height) ++ rt.term.row;
+    else if (rt.screen[0] != NULL) {
+        // Scroll the screen buffer up by one row.
+        cell_t *s = rt.screen[0];
+        memmove(s, s + rt.cols, (rt.rows - 1) * rt.cols * sizeof(cell_t));
+        term_blank(s + (rt.rows - 1) * rt.cols, rt.cols);
+}}
+
+/// Update the cursor position as if the character c were printed.
+void term_advance(int c) {
+    if (c == '\n') term_newline();
+    else if (c == '\r') rt.term.col = 1;
+    else if (c == '\b') { if (rt.term.col > 1) -- rt.term.col; }
+    else if (c == '\t') rt.term.col += 8 - (rt.term.col - 1) % 8;
+    else ++ rt.term.col;
+    // Lines longer than the terminal width wrap.
+    if (rt.term.col > rt.term.width) term_newline();
+}
+
+/** Print character c on stdout updating the cursor position: if the screen
+    buffer is active, the character is written on it, instead. */
+void term_putc(int c) {
+    if (rt.screen[0] == NULL) fputc(c, rt.out);
+    else if (c >= ' ' && rt.term.row <= rt.rows && rt.term.col <= rt.cols) {
+        cell_t *p = rt.screen[0] + (rt.term.row-1) * rt.cols + rt.term.col-1;
+        p->ch = c;
+        p->attr = rt.attr;
+    }
+    term_advance(c);
+}
+
+/// Print string s on stdout updating the cursor position.
+void term_puts(const char *s) {
+    if (rt.screen[0] == NULL) {
+        fputs(s, rt.out);
+        while (*s != '\0') term_advance(*s++);
+    } else {
+        while (*s != '\0') term_putc(*s++);
+}}
+
+/** Print on p the escape sequence which sets the attributes a, returning the
+    number of printed characters. What is printed depends on the compliancy
+    of the terminal with ECMA-48. */
+int term_attr_escape(char *p, int a) {
+    return sprintf(p, "\033[0%s%s%s%s%s;38;2;%i;%i;%i;48;2;%i;%i;%im",
+        a & ATTR_BOLD ? ";1" : "", a & ATTR_BRIGHT ? "" : ";2",
+        a & ATTR_UNDER ? ";4" : "", a & ATTR_BLINK ? ";5" : "",
+        a & ATTR_REVERSE ? ";7" : "",
+        255*!!(a & 4), 255*!!(a & 2), 255*!!(a & 1),
+        255*!!(a & 32), 255*!!(a & 16), 255*!!(a & 8));
+}
+
+/** Send to the terminal the cells of the screen buffer which changed since
+    the last refresh, with a single write. If the terminal has been resized,
+    the buffers are resized, too, and the whole screen is redrawn. */
+void term_refresh(void) {
+    if (rt.screen[0] == NULL) return;
+    if (rt.rows != rt.term.height || rt.cols != rt.term.width) {
+        // The back buffer is copied, the front one redrawn after clearing.
+        cell_t *old = rt.screen[0];
+        int rows = rt.rows, cols = rt.cols, n = rt.term.height * rt.term.width;
+        free(rt.screen[1]);
+        rt.screen[0] = malloc(n * sizeof(cell_t));
+        rt.screen[1] = malloc(n * sizeof(cell_t));
+        if (rt.screen[0] == NULL || rt.screen[1] == NULL) {
+            free(old); free(rt.screen[0]); free(rt.screen[1]);
+            rt.screen[0] = rt.screen[1] = NULL;
+            ERROR(OUT_OF_VARIABLES);
+        }
+        rt.rows = rt.term.height;
+        rt.cols = rt.term.width;
+        term_blank(rt.screen[0], n);
+        term_blank(rt.screen[1], n);
+        for (int i = 0; i < rows && i < rt.rows; ++ i)
+            memcpy(rt.screen[0] + i * rt.cols, old + i * cols,
+                (cols < rt.cols ? cols : rt.cols) * sizeof(cell_t));
+        free(old);
+        fputs("\033[2J", rt.out);
+    }
+    // Any changed cell takes at most 64 bytes: positioning, attributes, char.
+    static _Thread_local char *out = NULL;
+    static _Thread_local int out_size = 0;
+    int n = rt.rows * rt.cols;
+    if (out_size < 64 * n + 64) {
+        free(out);
+        out = malloc(out_size = 64 * n + 64);
+        if (out == NULL) { out_size = 0; return; }
+    }
+    char *p = out;
+    cell_t *back = rt.screen[0], *front = rt.screen[1];
+    int next = -1, attr = -1;   // Cursor position and attribute on terminal.
+    for (int i = 0; i < n; ++ i) {
+        if (back[i].ch == front[i].ch && back[i].attr == front[i].attr)
+            continue;
+        if (i != next) p += sprintf(p, "\033[%i;%iH", i/rt.cols+1, i%rt.cols+1);
+        if (back[i].attr != attr) p += term_attr_escape(p, attr = back[i].attr);
+        *p++ = back[i].ch;
+        next = i + 1;
+        front[i] = back[i];
+    }
+    if (p == out) return;
+    // Restore the cursor position and the current attributes.
+    p += sprintf(p, "\033[%i;%iH", rt.term.row, rt.term.col);
+    p += term_attr_escape(p, rt.attr);
+    fwrite(out, 1, p - out, rt.out);
+    fflush(rt.out);
+}
+
+/** Activate (on != 0) or deactivate the screen buffer: when activated it
+    contains the blank screen, and the terminal is cleared; when deactivated
+    it is refreshed for the last time and freed. */
+void term_buffer(int on) {
+    if (!on) {
+        term_refresh();
+        free(rt.screen[0]); free(rt.screen[1]);
+        rt.screen[0] = rt.screen[1] = NULL;
+    } else if (rt.screen[0] == NULL) {
+        int n = rt.term.height * rt.term.width;
+        rt.screen[0] = malloc(n * sizeof(cell_t));
+        rt.screen[1] = malloc(n * sizeof(cell_t));
+        if (rt.screen[0] == NULL || rt.screen[1] == NULL) {
+            free(rt.screen[0]); free(rt.screen[1]);
+            rt.screen[0] = rt.screen[1] = NULL;
+            ERROR(OUT_OF_VARIABLES);
+        }
+        rt.rows = rt.term.height;
+        rt.cols = rt.term.width;
+        term_blank(rt.screen[0], n);
+        memcpy(rt.screen[1], rt.screen[0], n * sizeof(cell_t));
+        fputs("\033[2J", rt.out);
+}}
+
+/// Clear the screen and move the cursor to the top-left corner.
+void term_cls(void) {
+    if (rt.screen[0] != NULL) term_blank(rt.screen[0], rt.rows * rt.cols);
+    else if (!rt.batch) fputs("\033[2J\033[1;1f", rt_msg());
+    term_home();
+}
+
+/** Move the cursor to row and column: both are reduced modulo the terminal
+    dimensions. A batch output cannot be addressed, so nothing is printed. */
+void term_at(int row, int col) {
+    row %= rt.term.height;
+    col %= rt.term.width;
+    if (rt.batch) return;
+    if (rt.screen[0] == NULL) fprintf(rt.out, "\033[%i;%if", row, col);
+    rt.term.row = row < 1 ? 1 : row;
+    rt.term.col = col < 1 ? 1 : col;
+}
+
+/** Move the cursor to column col (from 1) of the current row: in batch mode
+    spaces are printed, starting a new line if col is before the cursor. */
+void term_column(int col) {
+    if (col < 1) col = 1;
+    if (rt.batch) {
+        if (rt.term.col > col) term_putc('\n');
+        while (rt.term.col < col) term_putc(' ');
+    } else {
+        if (rt.screen[0] == NULL) fprintf(rt.out, "\033[%iG", col);
+        rt.term.col = col;
+}}
+
+/** Move to the next tabulation stop, or to the next line if the stop falls
+    outside the terminal. */
+void term_tab(void) {
+    int col = rt.term.col + TAB_SIZE - rt.term.col % TAB_SIZE;
+    if (col < rt.term.width) term_column(col); else term_putc('\n');
+}
+
 /// \}
 /// \defgroup MEMORY Memory Access
 /// \{
 
 addr_t peek(byte_t *a) { return *a + (a[1] << 8); }
-num_t peek_num(byte_t *a) { return *(num_t*)a; }
+num_t peek_num(byte_t *a) { num_t n; memcpy(&n, a, sizeof(n)); return n; }
 void poke(byte_t *a, addr_t i) { *a = i & 0xFF; a[1] = i >> 8; }
-void poke_num(byte_t *a, num_t n) { *(num_t*)a = n; }
+void poke_num(byte_t *a, num_t n) { memcpy(a, &n, sizeof(n)); }
 
 #define PEEK(a) (peek(RAM + (a)))
 #define PEEK_NUM(a) (peek_num(RAM + (a)))
@@ -298,90 +810,118 @@ void poke_num(byte_t *a, num_t n) { *(num_t*)a = n; }
 /// \{
 
 void dump_channels(void) {
-    fputs("CHANNELS:\n   ", stdout);
-    for (int i = 0; i < 1 + BUF_NUM; ++ i)
-        printf(" #%i %s.", i, rt.channels[i] == NULL ? "FREE" : "BUSY");
-    putchar('\n');
+    fputs("CHANNELS:\n   ", rt.out);
+    int free = 0;
+    for (int i = 1; i < rt.chan_num; ++ i) {
+        chan_t *c = &rt.chan[i];
+        if (c->file == NULL) { ++ free; continue; }
+        extern void chan_count(chan_t*, unsigned long*, unsigned long*);
+        unsigned long bytes, lines;
+        chan_count(c, &bytes, &lines);
+        fprintf(rt.out, " #%i BUSY %lu BYTES %lu %s.", i, bytes, lines,
+            c->reclen > 0 ? "RECORDS" : "LINES");
+    }
+    fprintf(rt.out, " %i FREE OF %i.\n", free + rt.chan_max - rt.chan_num, rt.chan_max - 1);
+}
+
+void dump_functions(void) {
+    fputs("FUNCTIONS:\n   ", rt.out);
+    for (int i = 0; i < rt.fn_num; ++ i) {
+        fn_t *f = &rt.fn[i];
+        fprintf(rt.out, " %s", RAM + f->name);
+        if (f->pure) fprintf(rt.out, " PURE %lu HITS %lu MISSES", f->hits, f->misses);
+        fputc('.', rt.out);
+    }
+    fprintf(rt.out, " %i FOUND.\n", rt.fn_num);
 }
 
 void dump_cstr(void) {
-    puts("STRINGS:");
+    fputs("STRINGS:\n", rt.out);
     for (addr_t p = rt.csp0; p < rt.csp; p += strlen(rt.ram + p) + 1)
-        printf(" \"%s\"", rt.ram + p);
-    if (rt.csp0 < rt.csp) putchar('\n');
+        fprintf(rt.out, " \"%s\"", rt.ram + p);
+    if (rt.csp0 < rt.csp) fputc('\n', rt.out);
 }
 
 void dump_memory(void) {
-    fputs("MEMORY:\n   ", stdout);
-    printf("STRINGS = %i/%i (%2i%%);", rt.csp - rt.csp0, rt.pp0 - rt.csp0, (int)(100.0*(rt.csp - rt.csp0) / (rt.pp0 - rt.csp0)));
-    printf(" PROGRAM = %i/%i (%2i%%);", rt.pp - rt.pp0, rt.vp0 - rt.pp0, (int)(100.0*(rt.pp - rt.pp0) / (rt.vp0 - rt.pp0)));
-    printf(" VARIABLES = %i/%i (%2i%%)\n", rt.vp - rt.vp0, rt.sp - rt.vp0, (int)(100.0*(rt.vp - rt.vp0) / (rt.sp - rt.vp0)));
-    puts("MEMORY MAP:\n    | strings | program | variables | free space | stacks | buffers |");
-    printf("  %04X      %04X      %04X        %04X         %04X     %04X      FFFF\n",
+    fputs("MEMORY:\n   ", rt.out);
+    fprintf(rt.out, "STRINGS = %i/%i (%2i%%);", rt.csp - rt.csp0, rt.pp0 - rt.csp0, (int)(100.0*(rt.csp - rt.csp0) / (rt.pp0 - rt.csp0)));
+    fprintf(rt.out, " PROGRAM = %i/%i (%2i%%);", rt.pp - rt.pp0, rt.vp0 - rt.pp0, (int)(100.0*(rt.pp - rt.pp0) / (rt.vp0 - rt.pp0)));
+    fprintf(rt.out, " VARIABLES = %i/%i (%2i%%)", rt.vp - rt.vp0, rt.sp - rt.vp0, (int)(100.0*(rt.vp - rt.vp0) / (rt.sp - rt.vp0)));
+    extern int var_padding(addr_t);
+    int padding = 0;
+    for (addr_t v = rt.vp0; v < rt.vp; v += PEEK(v)) padding += var_padding(v);
+    fprintf(rt.out, ", PADDING = %i\n", padding);
+    fputs("MEMORY MAP:\n    | strings | program | variables | free space | stacks | buffers |\n", rt.out);
+    fprintf(rt.out, "  %04X      %04X      %04X        %04X         %04X     %04X      FFFF\n",
         rt.csp0, rt.pp0, rt.vp0, rt.vp, rt.sp0, rt.obj);
-    printf("REGISTERS:\n    IP = %04X, PP = %04X, VP = %04X, "
+    fprintf(rt.out, "REGISTERS:\n    IP = %04X, PP = %04X, VP = %04X, "
         "SP = %04X, RP = %04X\n", rt.ip, rt.pp, rt.vp, rt.sp, rt.rsp);
 }
 
 void dump_variables(void) {
-    puts("VARIABLES:");
+    fputs("VARIABLES:\n", rt.out);
     for (addr_t p = rt.vp0; p < rt.vp; p += PEEK(p)) {
-        fputc(' ', stderr);
-        fputs(RAM + PEEK(p + sizeof(addr_t)), stderr);  // Name.
-        addr_t p1 = p + 2*sizeof(addr_t);
-        int type = RAM[p1++];
-        if (type & VAR_VEC) {
+        fputc(' ', rt_msg());
+        fputs(RAM + PEEK(p + sizeof(addr_t)), rt.msg);  // Name.
+        int type = RAM[p + 2*sizeof(addr_t)];
+        addr_t p1 = p + VAR_HEAD;
+        if (type & VAR_MAP) {
+            extern void map_dump(addr_t);
+            map_dump(p);
+        } else if (type & VAR_VEC) {
             int d1 = PEEK(p1);
             p1 += sizeof(addr_t);
-            fprintf(stderr, "(%i) = |", d1);
+            if (type & VAR_NUM) p1 = VAR_ALIGNED(p1);
+            fprintf(rt.msg, "(%i) = |", d1);
             for (int i = 0; i < d1; ++ i) {
                 if (i > 2 && i < d1 - 1) {
-                    fputs(" ... ", stderr);
+                    fputs(" ... ", rt.msg);
                     i = d1 - 2;
                     continue;
                 }
                 if (type & VAR_NUM) {
-                    fprintf(stderr, " %g", PEEK_NUM(p1));
+                    fprintf(rt.msg, " %g", PEEK_NUM(p1));
                     p1 += sizeof(num_t);
                 } else {
-                    fprintf(stderr, " \"%s\"", RAM + p1);
+                    fprintf(rt.msg, " \"%s\"", RAM + p1);
                     p1 += strlen(RAM + p1) + 1;
             }}
-            fputs("|\n", stderr);
+            fputs("|\n", rt.msg);
         } else if (type & VAR_MAT) {
             int d1 = PEEK(p1), d2 = PEEK(p1 + sizeof(addr_t));
             p1 += 2*sizeof(addr_t);
-            fprintf(stderr, "(%i,%i) = |", d1, d2);
+            if (type & VAR_NUM) p1 = VAR_ALIGNED(p1);
+            fprintf(rt.msg, "(%i,%i) = |", d1, d2);
             for (int i = 0; i < d1; ++ i) {
                 if (i > 2 && i < d1 - 1) {
-                    fputs(" ... ", stderr);
+                    fputs(" ... ", rt.msg);
                     i = d1 - 2;
                 } else
                 for (int j = 0; j < d2; ++ j) {
                     if (j > 2 && j < d2 - 1) {
-                        fputs(" ... ", stderr);
+                        fputs(" ... ", rt.msg);
                         j = d2 - 2;
                         continue;
                     }
                     if (type & VAR_NUM) {
-                        fprintf(stderr, " %g", PEEK_NUM(p1));
+                        fprintf(rt.msg, " %g", PEEK_NUM(p1));
                         p1 += sizeof(num_t);
                     } else {
-                        fprintf(stderr, " \"%s\"", RAM + p1);
+                        fprintf(rt.msg, " \"%s\"", RAM + p1);
                         p1 += strlen(RAM + p1) + 1;
                 }}
-                fputs(" ;", stderr);
+                fputs(" ;", rt.msg);
             }
-            fputs("|\n", stderr);
+            fputs("|\n", rt.msg);
         } else if (type == VAR_NUM) {
-            fprintf(stderr, " = %g\n", PEEK_NUM(p1));
+            fprintf(rt.msg, " = %g\n", PEEK_NUM(p1));
         } else if (type == VAR_FOR) {
-            fprintf(stderr, " = %g TO %g STEP %g\n", PEEK_NUM(p1),
+            fprintf(rt.msg, " = %g TO %g STEP %g\n", PEEK_NUM(p1),
                 PEEK_NUM(p1 + sizeof(num_t)), PEEK_NUM(p1 + 2*sizeof(num_t)));
         } else if (type == VAR_STR) {
-            fprintf(stderr, " = \"%s\"\n", RAM + p1);
+            fprintf(rt.msg, " = \"%s\"\n", RAM + p1);
         } else {
-            fputs(" UNKNOWN!!!\n", stderr);
+            fputs(" UNKNOWN!!!\n", rt.msg);
 }}}
 
 /// \}
@@ -496,17 +1036,25 @@ int cstr_add(char *p0, int len) {
     return k;
 }
 
+/** Allocate a temporary string of len characters, whose contents are left
+    to the caller to fill, and return its address.
+    \exception If the string can't be allocated. */
+int cstr_new_temp(long len) {
+    if (len < 0 || rt.tsp + len + 1 >= rt.pp0) ERROR(OUT_OF_STRINGS);
+    int k = rt.tsp;
+    rt.tsp += len + 1;
+    RAM[k + len] = '\0';
+    return k;
+}
+
 /** Add a temporary string to the data area and return its address: if there's
     no more space then return a negative number.
     \param rt runtime object. \param p string to add \param len length of p.
     \return the addr_t of the new temporary string.
     \exception If the string can't be allocated. */
 int cstr_add_temp(char *p, int len) {
-    if (rt.tsp + len + 1 >= rt.pp0) ERROR(OUT_OF_STRINGS);
-    int k = rt.tsp;
-    rt.tsp += len + 1;
+    int k = cstr_new_temp(len);
     memcpy(RAM + k, p, len);
-    RAM[k + len] = '\0';
     return k;
 }
 
@@ -524,6 +1072,208 @@ int cstr_find(char *p0, int len) {
     return -1;
 }
 
+/** \defgroup PAT Pattern Matching
+
+    Patterns are simple regular expressions: alternatives p|q|... of sequences
+    of atoms, each one a character, "." for any character, a \\-escaped
+    character or a class [...] of characters and ranges a-z, negated if it
+    starts with ^. An atom may be followed by "*", "+" or "?", an alternative
+    may start with "^" and end with "$" to anchor it to the start or end of
+    the text, while a leading "(?i)" ignores the case.
+
+    A pattern is compiled into positions, one for each atom plus one for the
+    end of each alternative: a set of positions, stored as the bits of a
+    uint64_t, is a state of a DFA whose transitions are computed only when
+    needed while matching, and then remembered. */
+/// \{
+
+/** A compiled pattern: cls[i] is the class of characters accepted by the
+    position i, whose bit in loop is set if it can repeat and in opt if it can
+    be skipped; accept marks the ends of alternatives, and end those which
+    match only at the end of the text. start and start0 are the initial sets
+    of positions, at offset > 0 and 0 of the text, and init, init0 the
+    corresponding states, or -1. set[0:states] are the DFA states, set[0]
+    being the dead one, and next[q][c] is the state reached from q reading
+    c, or -1 if not yet computed. */
+typedef struct pat {
+    char *src;
+    unsigned long tick;
+    int n, states, init, init0;
+    uint64_t loop, opt, accept, end, start, start0;
+    uint64_t cls[PAT_ATOMS][4];
+    uint64_t set[PAT_STATES];
+    int16_t next[PAT_STATES][256];
+} pat_t;
+
+#define PAT_BIT(i) ((uint64_t)1 << (i))
+#define PAT_HAS(p, i, c) ((p)->cls[i][(c) >> 6] >> ((c) & 63) & 1)
+
+/// Add to the set s all positions which can be reached skipping atoms.
+uint64_t pat_closure(pat_t *p, uint64_t s) {
+    for (int i = 0; i < p->n; ++ i)
+        if (s & p->opt & PAT_BIT(i)) s |= PAT_BIT(i + 1);
+    return s;
+}
+
+/** Return the DFA state of the set s, adding it if needed: if the DFA is
+    full, it is emptied but for the dead state. */
+int pat_state(pat_t *p, uint64_t s) {
+    for (int q = 0; q < p->states; ++ q)
+        if (p->set[q] == s) return q;
+    if (p->states == PAT_STATES) p->states = 1, p->init = p->init0 = -1;
+    p->set[p->states] = s;
+    memset(p->next[p->states], -1, sizeof(p->next[0]));
+    return p->states ++;
+}
+
+/// Return the state reached from q reading c, computing it the first time.
+int pat_step(pat_t *p, int q, byte_t c) {
+    int r = p->next[q][c];
+    if (r < 0) {
+        uint64_t s = p->set[q], t = 0;
+        for (int i = 0; i < p->n; ++ i)
+            if (s & PAT_BIT(i) && PAT_HAS(p, i, c))
+                t |= PAT_BIT(i + 1) | (p->loop & PAT_BIT(i));
+        r = pat_state(p, pat_closure(p, t));
+        // If the DFA was emptied, q may be a different state now.
+        if (q < p->states && p->set[q] == s) p->next[q][c] = r;
+    }
+    return r;
+}
+
+/// Parse an atom at s into the class of position n and return what follows.
+const char *pat_atom(pat_t *p, const char *s, int nocase) {
+    uint64_t *cls = p->cls[p->n];
+    memset(cls, 0, sizeof(p->cls[0]));
+    if (*s == '.') {
+        memset(cls, -1, sizeof(p->cls[0]));
+        ++ s;
+    } else if (*s == '[') {
+        int negate = *++ s == '^';
+        s += negate;
+        // A "]" just after "[" or "[^" is a character of the class.
+        do {
+            if (*s == '\\') ++ s;
+            if (*s == '\0') ERROR(PATTERN);
+            byte_t a = *s ++, b = a;
+            if (s[0] == '-' && s[1] != ']' && s[1] != '\0') {
+                s += 1 + (s[1] == '\\');
+                if (*s == '\0' || (b = *s ++) < a) ERROR(PATTERN);
+            }
+            for (int c = a; c <= b; ++ c) cls[c >> 6] |= PAT_BIT(c & 63);
+        } while (*s != ']');
+        ++ s;
+        if (negate) for (int i = 0; i < 4; ++ i) cls[i] = ~cls[i];
+    } else {
+        if (*s == '*' || *s == '+' || *s == '?') ERROR(PATTERN);
+        if (*s == '\\') ++ s;
+        if (*s == '\0') ERROR(PATTERN);
+        byte_t c = *s ++;
+        cls[c >> 6] |= PAT_BIT(c & 63);
+    }
+    if (nocase) for (int c = 'A'; c <= 'Z'; ++ c)
+        if (PAT_HAS(p, p->n, c) || PAT_HAS(p, p->n, c + 32)) {
+            cls[c >> 6] |= PAT_BIT(c & 63);
+            cls[(c + 32) >> 6] |= PAT_BIT((c + 32) & 63);
+        }
+    if (*s == '*' || *s == '?') p->opt |= PAT_BIT(p->n);
+    if (*s == '*' || *s == '+') p->loop |= PAT_BIT(p->n);
+    if (*s == '*' || *s == '+' || *s == '?') ++ s;
+    return s;
+}
+
+/// Compile the pattern s into p, raising an error if it is illegal.
+void pat_compile(pat_t *p, const char *s) {
+    int nocase = strncmp(s, "(?i)", 4) == 0;
+    if (nocase) s += 4;
+    p->n = 0;
+    p->loop = p->opt = p->accept = p->end = p->start = p->start0 = 0;
+    for (;;) {
+        int first = p->n, anchored = *s == '^';
+        s += anchored;
+        // A "$" is an anchor only at the end of an alternative.
+        while (*s != '\0' && *s != '|'
+        &&  !(s[0] == '$' && (s[1] == '\0' || s[1] == '|'))) {
+            if (p->n == PAT_ATOMS - 1) ERROR(PATTERN);
+            s = pat_atom(p, s, nocase);
+            ++ p->n;
+        }
+        if (*s == '$') {
+            p->end |= PAT_BIT(p->n);
+            ++ s;
+        } else {
+            p->accept |= PAT_BIT(p->n);
+        }
+        memset(p->cls[p->n], 0, sizeof(p->cls[0]));
+        p->start0 |= PAT_BIT(first);
+        if (!anchored) p->start |= PAT_BIT(first);
+        ++ p->n;
+        if (*s == '\0') break;
+        if (p->n == PAT_ATOMS) ERROR(PATTERN);
+        ++ s;
+    }
+    p->start = pat_closure(p, p->start);
+    p->start0 = pat_closure(p, p->start0);
+    p->states = 0;
+    pat_state(p, 0);
+    p->init = p->init0 = -1;
+}
+
+/** Return the compiled pattern of the string s, looking for it in the cache
+    or else compiling it in place of the least recently used one. */
+pat_t *pat_get(const char *s) {
+    int k = 0;
+    unsigned long oldest = ++ rt.pat_tick;
+    for (int i = 0; i < PAT_CACHE; ++ i) {
+        pat_t *p = rt.pat[i];
+        // Free entries are the oldest ones.
+        unsigned long tick = p == NULL || p->src == NULL ? 0 : p->tick;
+        if (tick > 0 && strcmp(p->src, s) == 0) {
+            p->tick = rt.pat_tick;
+            return p;
+        }
+        if (tick < oldest) oldest = tick, k = i;
+    }
+    if (rt.pat[k] == NULL && (rt.pat[k] = calloc(1, sizeof(pat_t))) == NULL)
+        ERROR(OUT_OF_STRINGS);
+    pat_t *p = rt.pat[k];
+    // If the compilation fails, the entry remains free.
+    free(p->src);
+    p->src = NULL;
+    pat_compile(p, s);
+    if ((p->src = strdup(s)) == NULL) ERROR(OUT_OF_STRINGS);
+    p->tick = rt.pat_tick;
+    return p;
+}
+
+/** Look for the leftmost longest match of p inside h[0:len]: if found then
+    return 1 and set *i, *j so that it is h[*i:*j], else return 0. */
+int pat_match(pat_t *p, const byte_t *h, long len, long *i, long *j) {
+    for (long k = 0; k <= len; ++ k) {
+        if (k > 0 && p->start == 0) break;  // Anchored at start.
+        int q;
+        if (k == 0) {
+            if (p->init0 < 0) p->init0 = pat_state(p, p->start0);
+            q = p->init0;
+        } else {
+            if (p->init < 0) p->init = pat_state(p, p->start);
+            q = p->init;
+        }
+        long e = -1;
+        for (long l = k; ; ++ l) {
+            uint64_t s = p->set[q];
+            if (s & p->accept || (l == len && s & p->end)) e = l;
+            if (l == len || (q = pat_step(p, q, h[l])) == 0) break;
+        }
+        if (e >= 0) {
+            *i = k;
+            *j = e;
+            return 1;
+        }
+    }
+    return 0;
+}
+
 /// \}
 /** \defgroup OPER Operators Implementation
 
@@ -560,6 +1310,110 @@ void oper_empty_string(void)
     push_str(rt.csp - 1);
 }
 
+/// Pop a channel number, check that it is opened and return it.
+int oper_channel(void) {
+    extern int chan_opened(int);
+    return chan_opened(pop_num());
+}
+
+/// Return 1 if p[0:m] is the same as n[0:m], but for case if nocase != 0.
+int oper_match(const char *p, const char *n, long m, int nocase) {
+    return (nocase ? strncasecmp(p, n, m) : memcmp(p, n, m)) == 0;
+}
+
+/** Return the offset of the first occurrence of n[0:m] inside h, or the last
+    one if reverse != 0, starting from lo to hi, or -1 if there is none: the
+    case is ignored if nocase != 0 and h should contain hi + m characters.
+    Candidates are filtered 16 at a time comparing their first and last
+    characters, folded by | 0x20 if the case is ignored. */
+long oper_search(const char *h, long lo, long hi, const char *n, long m,
+                 int reverse, int nocase) {
+    if (m == 0) return reverse ? hi : lo;
+    int fold = nocase ? 0x20 : 0;
+    char first = n[0] | fold, last = n[m - 1] | fold;
+#if defined(__SSE2__)
+    __m128i vfold = _mm_set1_epi8(fold);
+    __m128i vfirst = _mm_set1_epi8(first), vlast = _mm_set1_epi8(last);
+    // Bit k of the result is set if i + k is a candidate.
+#   define CANDIDATES(i) _mm_movemask_epi8(_mm_and_si128( \
+        _mm_cmpeq_epi8(vfirst, _mm_or_si128(vfold, \
+            _mm_loadu_si128((const __m128i*)(h + (i))))), \
+        _mm_cmpeq_epi8(vlast, _mm_or_si128(vfold, \
+            _mm_loadu_si128((const __m128i*)(h + (i) + m - 1))))))
+    if (!reverse) {
+        for (; lo + 15 <= hi; lo += 16)
+            for (unsigned bits = CANDIDATES(lo); bits; bits &= bits - 1) {
+                long i = lo + __builtin_ctz(bits);
+                if (oper_match(h + i, n, m, nocase)) return i;
+            }
+    } else {
+        for (; hi - 15 >= lo; hi -= 16)
+            for (unsigned bits = CANDIDATES(hi - 15); bits; ) {
+                int k = 31 - __builtin_clz(bits);
+                if (oper_match(h + hi - 15 + k, n, m, nocase)) return hi - 15 + k;
+                bits &= ~(1u << k);
+            }
+    }
+#   undef CANDIDATES
+#endif
+    for (; lo <= hi; reverse ? -- hi : ++ lo) {
+        long i = reverse ? hi : lo;
+        if ((h[i] | fold) == first && (h[i + m - 1] | fold) == last
+        &&  oper_match(h + i, n, m, nocase)) return i;
+    }
+    return -1;
+}
+
+/** Pop the parameters of INSTR(i, h, n) and push the position of the first
+    occurrence of n inside h, from the position i on, or of the last one up
+    to the position LEN h + 1 + i if i < 0, or 0 if there is none. */
+void oper_instr(int nocase) {
+    const char *n = RAM + pop_str(), *h = RAM + pop_str();
+    long i = pop_num(), len = strlen(h), m = strlen(n), lo = 0, hi = len - m;
+    if (i == 0) ERROR(SUBSCRIPT_RANGE);
+    if (i > 0) lo = i - 1;
+    else if (len + i < hi) hi = len + i;
+    push_num(lo > hi ? 0 : oper_search(h, lo, hi, n, m, i < 0, nocase) + 1);
+}
+
+/** Convert p[0:len] to uppercase if upper != 0, else to lowercase: letters
+    are looked for 16 at a time, and their case bit flipped. */
+void oper_case(byte_t *p, long len, int upper) {
+    byte_t lo = upper ? 'a' : 'A', hi = lo + 25;
+    long i = 0;
+#if defined(__SSE2__)
+    __m128i vlo = _mm_set1_epi8(lo - 1), vhi = _mm_set1_epi8(hi + 1);
+    __m128i bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= len; i += 16) {
+        // Characters > 127 are negative, so they are never letters.
+        __m128i c = _mm_loadu_si128((__m128i*)(p + i));
+        __m128i in = _mm_and_si128(_mm_cmpgt_epi8(c, vlo), _mm_cmplt_epi8(c, vhi));
+        _mm_storeu_si128((__m128i*)(p + i),
+                         _mm_xor_si128(c, _mm_and_si128(in, bit)));
+    }
+#endif
+    for (; i < len; ++ i)
+        if (p[i] >= lo && p[i] <= hi) p[i] ^= 0x20;
+}
+
+/// Pop a string, push a temporary copy of it with letters in a single case.
+void oper_case_string(int upper) {
+    byte_t *s = RAM + pop_str();
+    long len = strlen(s);
+    int k = cstr_add_temp(s, len);
+    oper_case(RAM + k, len, upper);
+    push_str(k);
+}
+
+/** Fill p[0:len] repeating the m characters at n, copying each time all
+    of what is already filled, so that log(len / m) copies are needed. */
+void oper_repeat(byte_t *p, long len, const byte_t *n, long m) {
+    if (len == 0) return;
+    memcpy(p, n, m < len ? m : len);
+    for (long k = m; k < len; k *= 2)
+        memcpy(p + k, p, k < len - k ? k : len - k);
+}
+
 /// Create a temporary string concatenating s1 and s2 and return it.
 str_t oper_concat(str_t s1, str_t s2) {
     // Create the concatenation as temporary string.
@@ -596,12 +1450,8 @@ void OPER_ASN(void) {
 void OPER_AT(void) {
     // AT(i,j) is used for its side effect to position the cursor at row i and
     // column j; it returns the empty string.
-    char *w = getenv("COLUMNS"), *h = getenv("LINES");
-    const int WIDTH = w != NULL ? atoi(w) : 80;
-    const int HEIGHT = h != NULL ? atoi(h) : 24;
-    int col = (int)pop_num() % WIDTH;
-    int row = (int)pop_num() % HEIGHT;
-    printf("\033[%i;%if", row, col);
+    int col = pop_num();
+    term_at(pop_num(), col);
     oper_empty_string();
 }
 
@@ -619,10 +1469,7 @@ void OPER_CONCAT(void) {
     push_str(oper_concat(s1, s2));
 }
 
-void OPER_COL(void) {
-    char *c = getenv("COLUMNS");
-    push_num(c != NULL ? atoi(c) : 80);
-}
+void OPER_COL(void) { push_num(rt.term.width); }
 
 void OPER_COS(void) { push_num(cos(pop_num())); }
 
@@ -632,12 +1479,18 @@ void OPER_DIV(void) {
     push_num(pop_num() / n2);
 }
 
+void OPER_DOT(void) { extern void mat_reduce(int); mat_reduce(CODE_DOT); }
+
 void OPER_EOF(void) {
     // EOF(c) = 0 if c is opened and not yet ended, 1 if it is ended.
-    int ch = pop_num();
-    if (ch < 0 || ch > BUF_NUM) ERROR(ILLEGAL_CHANNEL);
-    if (rt.channels[ch] == NULL) ERROR(CHANNEL_CLOSED);
-    push_num(feof(rt.channels[ch]));
+    int ch = oper_channel();
+    extern int ra_ready(struct rbuf*);
+    extern off_t chan_size(int);
+    if (rt.chan[ch].map != NULL) push_num(rt.chan[ch].pos >= rt.chan[ch].size);
+    else if (rt.chan[ch].reclen > 0)
+        push_num((off_t)rt.chan[ch].pos * rt.chan[ch].reclen >= chan_size(ch));
+    else if (rt.chan[ch].ra != NULL) push_num(!ra_ready(rt.chan[ch].ra));
+    else push_num(feof(rt.chan[ch].file));
 }
 
 void OPER_EQ(void) { push_num(oper_cmp() == 0); }
@@ -653,16 +1506,16 @@ void OPER_IDIV(void) {
     push_num(d.quot);
 }
 
-void OPER_INKEY(void) { push_num(rt_inkey()); }
+void OPER_INKEY(void) { push_num(kbd_get(0)); }
 
 void OPER_INKEYS(void) {
-    int c;
-    while ((c = rt_inkey()) == 0)
-        ;
-    push_num(c);
+    term_refresh();     // Waiting for a key is a frame boundary.
+    push_num(kbd_get(1));
     OPER_CHRS();
 }
 
+void OPER_INSTR(void) { oper_instr(0); }
+void OPER_INSTRI(void) { oper_instr(1); }
 void OPER_INT(void) { push_num(floor(pop_num())); }
 
 void OPER_LEFTS(void) {
@@ -682,8 +1535,39 @@ void OPER_LOG(void) {
     push_num(log(n));
 }
 
+void OPER_LOF(void) {
+    // LOF(c) = length in bytes of the file opened on channel c.
+    extern off_t chan_size(int);
+    push_num(chan_size(oper_channel()));
+}
+
 void OPER_LT(void) { push_num(oper_cmp() < 0); }
 
+void OPER_MATCH(void) {
+    // MATCH(x$, p$) = position of the first match of p$ in x$, or 0.
+    pat_t *p = pat_get(RAM + pop_str());
+    byte_t *h = RAM + pop_str();
+    long i, j;
+    push_num(pat_match(p, h, strlen(h), &i, &j) ? i + 1 : 0);
+}
+
+void OPER_MATCHS(void) {
+    // MATCH$(x$, p$) = the first match of p$ in x$, or "".
+    pat_t *p = pat_get(RAM + pop_str());
+    byte_t *h = RAM + pop_str();
+    long i, j;
+    if (pat_match(p, h, strlen(h), &i, &j)) {
+        push_str(cstr_add_temp(h + i, j - i));
+    } else {
+        oper_empty_string();
+    }
+}
+
+void OPER_LOWERS(void) { oper_case_string(0); }
+
+void OPER_MAX(void) { extern void mat_reduce(int); mat_reduce(CODE_MAX); }
+void OPER_MEAN(void) { extern void mat_reduce(int); mat_reduce(CODE_MEAN); }
+
 void OPER_MIDS(void) {
     int n2 = pop_num();
     int n1 = pop_num() - 1;
@@ -694,6 +1578,8 @@ void OPER_MIDS(void) {
     push_str(cstr_add_temp(s1 + n1, n2));
 }
 
+void OPER_MIN(void) { extern void mat_reduce(int); mat_reduce(CODE_MIN); }
+
 void OPER_MINUS(void) {
     num_t n2 = pop_num(), n1 = pop_num();
     push_num(n1 - n2);
@@ -713,8 +1599,11 @@ void OPER_MUL(void) {
 
 void OPER_NEG(void) { push_num(-pop_num()); }
 void OPER_NEQ(void) { push_num(oper_cmp() != 0); }
+void OPER_NEXTKEYS(void) { extern void map_next(void); map_next(); }
 void OPER_NOT(void) { push_num(!pop_num()); }
 
+void OPER_NUM(void) { push_num(rt.num); }
+
 void OPER_OR(void) {
     num_t n2 = pop_num(), n1 = pop_num();
     push_num(n1 || n2);
@@ -742,6 +1631,31 @@ void OPER_POW(void) {
     push_num(n1);
 }
 
+void OPER_REPLACES(void) {
+    // REPLACE$(x$, y$, z$) = x$ with each occurrence of y$ replaced by z$.
+    byte_t *t = RAM + pop_str(), *n = RAM + pop_str(), *h = RAM + pop_str();
+    long len = strlen(h), m = strlen(n), l = strlen(t), count = 0;
+    if (m == 0) {
+        push_str(cstr_add_temp(h, len));
+        return;
+    }
+    // Count the occurrences first, so that the result is allocated once.
+    for (long i = 0; (i = oper_search(h, i, len - m, n, m, 0, 0)) >= 0; i += m)
+        ++ count;
+    int k = cstr_new_temp(len + count * (l - m));
+    byte_t *q = RAM + k;
+    for (long i = 0, j; i <= len; i = j + m) {
+        if ((j = i <= len - m ? oper_search(h, i, len - m, n, m, 0, 0) : -1) < 0)
+            j = len;
+        memcpy(q, h + i, j - i);
+        q += j - i;
+        if (j == len) break;
+        memcpy(q, t, l);
+        q += l;
+    }
+    push_str(k);
+}
+
 void OPER_RIGHTS(void) {
     int n2 = pop_num();
     char *s1 = RAM + pop_str();
@@ -750,11 +1664,17 @@ void OPER_RIGHTS(void) {
     push_str(cstr_add_temp(s1 + strlen(s1) - n2, n2));
 }
 
-void OPER_RND(void) { push_num((double)rand()/RAND_MAX); }
+void OPER_RND(void) {
+    push_num((double)rt_rand()/RAND_MAX);
+}
+
+void OPER_ROW(void) { push_num(rt.term.height); }
 
-void OPER_ROW(void) {
-    char *l = getenv("LINES");
-    push_num(l != NULL ? atoi(l) : 24);
+void OPER_SEEK(void) {
+    // SEEK(c) = number of the next record of the binary file on channel c.
+    int ch = oper_channel();
+    if (rt.chan[ch].reclen == 0) ERROR(ILLEGAL_MODE);
+    push_num(rt.chan[ch].pos + 1);
 }
 
 void OPER_SGN(void) {
@@ -764,18 +1684,39 @@ void OPER_SGN(void) {
 
 void OPER_SIN(void) { push_num(sin(pop_num())); }
 
+void OPER_SPACES(void) {
+    // SPACE$(n) = a string of n spaces.
+    long n = pop_num();
+    if (n < 0) ERROR(DOMAIN);
+    int k = cstr_new_temp(n);
+    memset(RAM + k, ' ', n);
+    push_str(k);
+}
+
 void OPER_SQR(void) {
     num_t n = pop_num();
     if (n < 0) ERROR(DOMAIN);
     push_num(sqrt(n));
 }
 
+void OPER_STATUS(void) { push_num(rt.status); }
+
 void OPER_STRS(void) {
     char s[32];
     sprintf(s, "%g", pop_num());
     push_str(cstr_add_temp(s, strlen(s)));
 }
 
+void OPER_STRINGS(void) {
+    // STRING$(n, x$) = x$ repeated n times.
+    byte_t *s = RAM + pop_str();
+    long n = pop_num(), m = strlen(s);
+    if (n < 0) ERROR(DOMAIN);
+    int k = cstr_new_temp(n * m);
+    oper_repeat(RAM + k, n * m, s, m);
+    push_str(k);
+}
+
 void OPER_SUBS(void) {
     // SUB$(x$, i, j) = substring of x$ from i-th to j-th character (included).
     int j = pop_num() - 1;
@@ -793,18 +1734,28 @@ void OPER_SUBS(void) {
     push_str(cstr_add_temp(s + i, j - i + 1));
 }
 
+void OPER_SUM(void) { extern void mat_reduce(int); mat_reduce(CODE_SUM); }
+
 void OPER_TAB(void) {
     // TAB(i) is used for its side effect to position the cursor at column j;
     // it returns the empty string.
-    char *w = getenv("COLUMNS");
-    const int WIDTH = w != NULL ? atoi(w) : 80;
-    printf("\033[%iG", (int)pop_num() % WIDTH);
+    term_column((int)pop_num() % rt.term.width);
     oper_empty_string();
 }
 
 void OPER_TAN(void) { push_num(tan(pop_num())); }
 void OPER_TIME(void) { push_num(time(NULL) - rt.t0); }
 
+void OPER_TRIMS(void) {
+    // TRIM$(x$) = x$ without leading and trailing blanks.
+    byte_t *s = RAM + pop_str();
+    long i = strspn(s, " \t"), j = strlen(s);
+    while (j > i && (s[j - 1] == ' ' || s[j - 1] == '\t')) -- j;
+    push_str(cstr_add_temp(s + i, j - i));
+}
+
+void OPER_UPPERS(void) { oper_case_string(1); }
+
 void OPER_VAL(void) {
     char *p = RAM + pop_str();
     errno = 0;
@@ -817,11 +1768,13 @@ void OPER_VAL(void) {
     implementing it, an arity value which is the number of parameters of the
     operator plus a flag which is set if the operator is infix binary and a
     priority, used to pop it from the operator stack at the appropriated moment.
+    Operators with arity ARRAY_ARGS take whole arrays as parameters: their
+    function parses them and pushes the result.
     To add a new operator FOO, just add it to the following table, insert the
     corresponding CODE_FOO constant in the constants list and implement the
     corresponding OPER_FOO function. */
 const struct {
-    char name[8];
+    char name[12];
     void (*routine)(void);
     byte_t arity;       // # of operator parameters.
     byte_t infix;       // 1 if the operator is binary infix, else 0.
@@ -837,7 +1790,8 @@ const struct {
 /** \defgroup VAR Variables Management
 
     Variables are stored from vp0 to vp-1 in the RAM in one of the following
-    formats, that depend on the type of variable
+    formats, that depend on the type of variable, each one padded to a multiple
+    of VAR_ALIGN bytes
 
         size, name, VAR_NUM, n
         size, name, VAR_NUM|VAR_VEC, i, n1, ..., ni
@@ -846,21 +1800,96 @@ const struct {
         size, name, VAR_STR|VAR_VEC, i, s1, ..., si
         size, name, VAR_STR|VAR_MAT, i, j, s11, ..., s1i, ..., sj1, ..., sji
         size, name, VAR_FOR, n (value), n1 (bound), n2 (step), ip0, ip
+        size, name, VAR_NUM|VAR_MAP or VAR_STR|VAR_MAP, ... (see map_find)
 
     Here size is a 16 bit unsigned, name the address of a string, n, n1, ...
     numbers, s, s1, ... C-strings (NOT addresses!), i and j 16 bit unsigned.
     A VAR_FOR includes the current value, the bound and the step, plus the
     address of the line where NEXT should jump and the offset in the line
-    where NEXT should jump. */
+    where NEXT should jump.
+
+    Since vp0 is a multiple of VAR_ALIGN, so is the address of each variable:
+    the type field is padded to VAR_HEAD bytes, so that n, n1, ... are aligned
+    as numbers, and the items of numerical arrays start VAR_ALIGN bytes after
+    the variable, so that they are aligned for the SIMD kernels. Variables
+    containing strings end with at least one padding byte, and each of their
+    padding bytes contains the number of padding bytes. */
 /// \{
 
 // Some shortcuts: they retrieve the address/value of a variable's field.
 #define VAR_SIZE(v) (PEEK((v)))
 #define VAR_NAME(v) ((v) + sizeof(addr_t))
 #define VAR_TYPE(v) (RAM[(v) + 2*sizeof(addr_t)])
-#define VAR_ADDR(v) ((v) + 2*sizeof(addr_t) + 1)
-#define VAR_TO(v) ((v) + 2*sizeof(addr_t) + 1 + sizeof(num_t))
-#define VAR_STEP(v) ((v) + 2*sizeof(addr_t) + 1 + 2*sizeof(num_t))
+#define VAR_ADDR(v) ((v) + VAR_HEAD)
+#define VAR_TO(v) ((v) + VAR_HEAD + sizeof(num_t))
+#define VAR_STEP(v) ((v) + VAR_HEAD + 2*sizeof(num_t))
+// Fields of a map variable v: see map_find.
+#define MAP_CAP(v) (VAR_ADDR(v))
+#define MAP_COUNT(v) (VAR_ADDR(v) + sizeof(addr_t))
+#define MAP_USED(v) (VAR_ADDR(v) + 2*sizeof(addr_t))
+#define MAP_END(v) (VAR_ADDR(v) + 3*sizeof(addr_t))
+#define MAP_LAST(v) (VAR_ADDR(v) + 4*sizeof(addr_t))
+#define MAP_SLOT(v, i) (VAR_ADDR(v) + (5 + (i))*sizeof(addr_t))
+
+/// Return the address of the first item of the array variable v.
+addr_t var_items(addr_t v) {
+    if (VAR_TYPE(v) & VAR_NUM) return v + VAR_ALIGN;
+    return VAR_ADDR(v) + (VAR_TYPE(v) & VAR_MAT ? 2 : 1) * sizeof(addr_t);
+}
+
+/// Return the number of padding bytes of the variable v.
+int var_padding(addr_t v) {
+    int type = VAR_TYPE(v), size = VAR_SIZE(v);
+    int used = 2*sizeof(addr_t) + 1;
+    if (type & VAR_MAP) return VAR_HEAD - used;
+    if (type & VAR_STR) return RAM[v + size - 1] + VAR_HEAD - used;
+    if (type == VAR_NUM) used += sizeof(num_t);
+    else if (type == VAR_FOR) used += 3*sizeof(num_t) + 2*sizeof(addr_t);
+    else {
+        int n = PEEK(VAR_ADDR(v));
+        used += sizeof(addr_t);
+        if (type & VAR_MAT) {
+            n *= PEEK(VAR_ADDR(v) + sizeof(addr_t));
+            used += sizeof(addr_t);
+        }
+        used += n * sizeof(num_t);
+    }
+    return size - used;
+}
+
+/** The variables from the address a on have been moved by delta bytes:
+    update the addresses of the local ones. */
+void var_moved(addr_t a, long delta) {
+    for (int i = 0; i < rt.bind_num; ++ i)
+        if (rt.bind[i].addr >= a) rt.bind[i].addr += delta;
+}
+
+/// Delete the variable v, shifting the following ones.
+void var_delete(addr_t v) {
+    addr_t size = VAR_SIZE(v);
+    memmove(RAM + v, RAM + v + size, rt.vp - (v + size));
+    rt.vp -= size;
+    var_moved(v + size, -size);
+}
+
+/** Replace the len_old bytes at a, inside the string variable v, with len_new
+    bytes, left undefined: the following strings of v are shifted and so are
+    the following variables, if the size of v has to change. */
+void var_resize(addr_t v, addr_t a, long len_old, long len_new) {
+    long size = VAR_SIZE(v), end = v + size, used = end - RAM[end - 1];
+    long used_new = used + len_new - len_old;
+    long delta = VAR_ALIGNED(used_new + 1) - end;
+    if (delta >= rt.sp0 - rt.vp) ERROR(OUT_OF_VARIABLES);
+    // Grow v before shifting its strings, shrink it after.
+    if (delta > 0) memmove(RAM + end + delta, RAM + end, rt.vp - end);
+    memmove(RAM + a + len_new, RAM + a + len_old, used - (a + len_old));
+    if (delta < 0) memmove(RAM + end + delta, RAM + end, rt.vp - end);
+    rt.vp += delta;
+    var_moved(end, delta);
+    POKE(v, size + delta);
+    int pad = end + delta - used_new;
+    memset(RAM + used_new, pad, pad);
+}
 
 /** Create a new variable at the address rt.vp. According to the provided type,
     which is also returned as value, inserts the data from d1 on, while name and
@@ -870,14 +1899,23 @@ int var_create(addr_t name, int type, num_t d1, num_t d2,
                num_t step, addr_t ip0, addr_t ip) {
     // Insert the variable: size, name, type, dim1 and possibly dim2 fields.
     addr_t v = rt.vp;
-    if (rt.sp0 - v < 2*sizeof(addr_t) + 1 + sizeof(num_t)) goto Error;
+    // Room for any scalar or FOR variable.
+    if (rt.sp0 - v < 2*VAR_ALIGN) goto Error;
     POKE(VAR_NAME(v), name);
     VAR_TYPE(v) = type;
+    memset(RAM + v + 2*sizeof(addr_t) + 1, 0, VAR_HEAD - 2*sizeof(addr_t) - 1);
     rt.vp = VAR_ADDR(v);
     if (type == VAR_NUM) { POKE_NUM(rt.vp, 0); rt.vp += sizeof(num_t); }
     else if (type == VAR_STR) RAM[rt.vp++] = '\0';
-    else if (type == VAR_FOR) {
-        if (rt.sp0 - v < 4*sizeof(addr_t) + 1 + 3*sizeof(num_t)) goto Error;
+    else if (type & VAR_MAP) {
+        // Empty slots and room for as many short entries.
+        int size = 5*sizeof(addr_t) + MAP_SLOTS*(sizeof(addr_t) + VAR_ALIGN);
+        if (rt.sp0 - rt.vp < size + VAR_ALIGN) goto Error;
+        memset(RAM + rt.vp, 0, size);
+        POKE(MAP_CAP(v), MAP_SLOTS);
+        POKE(MAP_END(v), MAP_SLOT(v, MAP_SLOTS) - v);
+        rt.vp += size;
+    } else if (type == VAR_FOR) {
         // 5 consecutive values to store: value, to, step, ip0, ip.
         POKE_NUM(rt.vp, d1); rt.vp += sizeof(num_t);
         POKE_NUM(rt.vp, d2); rt.vp += sizeof(num_t);
@@ -890,12 +1928,12 @@ int var_create(addr_t name, int type, num_t d1, num_t d2,
         // A string array is initialized by empty strings that take one byte.
         int size = d1 * d2;
         if (numerical) size *= sizeof(num_t);
-        if (rt.sp0 - rt.vp < size + 2*sizeof(addr_t) + 1 + 2*sizeof(num_t))
-            goto Error;
+        if (rt.sp0 - rt.vp < size + 2*VAR_ALIGN) goto Error;
         POKE(rt.vp, d1); rt.vp += sizeof(addr_t);
         if (type & VAR_MAT) { POKE(rt.vp, d2); rt.vp += sizeof(addr_t); }
         // Allocates the actual array items.
         if (numerical) {
+            rt.vp = var_items(v);
             for (int i = 0; i < d1*d2; ++ i) {
                 POKE_NUM(rt.vp, 0);
                 rt.vp += sizeof(num_t);
@@ -904,7 +1942,10 @@ int var_create(addr_t name, int type, num_t d1, num_t d2,
             memset(RAM + rt.vp, 0, size);
             rt.vp += size;
     }}
-    // Finally writes the size field of the variable.
+    // Pad the variable and finally write its size field.
+    int pad = VAR_ALIGNED(rt.vp + ((type & VAR_STR) != 0)) - rt.vp;
+    memset(RAM + rt.vp, pad, pad);
+    rt.vp += pad;
     POKE(v, rt.vp - v);
     return type;
 Error:
@@ -912,8 +1953,10 @@ Error:
     ERROR(OUT_OF_VARIABLES);
 }
 
-/// Looks for a variable with name s and return its address, or NIL.
+/** Looks for a variable with name s and return its address, or NIL: local
+    variables of running functions come first. */
 str_t var_find(str_t s) {
+    if (rt.local != NULL && rt.local[s] != 0) return rt.bind[rt.local[s] - 1].addr;
     for (addr_t v = rt.vp0; v < rt.vp; v += VAR_SIZE(v)) {
         if (STREQ(PEEK(VAR_NAME(v)), s)) {
            return v;
@@ -961,11 +2004,17 @@ addr_t var_insert(addr_t name) {
     is updated to the token following che closed parenthesis. */
 int var_array_parse(addr_t *name, addr_t *d1, addr_t *d2) {
     extern num_t expr_num(void);
+    extern int token_word(const char*);
     int type = (CODE == CODE_IDN ? VAR_NUM : VAR_STR);
     *name = PEEK(IP + 1);       // Store the name address.
     IP += 1 + sizeof(addr_t);   // Skip the name address.
     // Parse the subscript (s).
     EXPECT('(', SUBSCRIPT);
+    if (token_word("MAP")) {
+        EXPECT(')', OPENPAR_WITHOUT_CLOSEPAR);
+        *d1 = *d2 = 0;
+        return type | VAR_MAP;
+    }
     *d1 = expr_num();
     if (*d1 == 0) ERROR(SUBSCRIPT_RANGE);
     if (CODE == ',') {
@@ -1005,7 +2054,7 @@ int var_array_address(int type, addr_t p, addr_t *a1) {
     // According to the type, compute the address *a1 of the item.
     type &= VAR_NUM | VAR_STR;
     if (type == VAR_NUM) {
-        *a1 = p + ((i-1)*d2 + j-1)*sizeof(num_t);
+        *a1 = VAR_ALIGNED(p) + ((i-1)*d2 + j-1)*sizeof(num_t);
     } else {
         int n = (i-1)*d2 + (j-1);   // Number of strings to skip.
         // Skip n strings.
@@ -1018,6 +2067,256 @@ int var_array_address(int type, addr_t p, addr_t *a1) {
     return type;
 }
 
+/// Return the FNV-1a hash of the len characters at p.
+unsigned map_hash(const char *p, size_t len) {
+    unsigned h = 2166136261u;
+    while (len-- > 0) h = (h ^ (byte_t)*p++) * 16777619u;
+    return h;
+}
+
+/// Return the size of the entry at e of a map of the given type.
+int map_entry_size(addr_t e, int type) {
+    int n = 1 + strlen(RAM + e + 1) + 1;
+    return n + (type & VAR_NUM ? sizeof(num_t) : strlen(RAM + e + n) + 1);
+}
+
+/** A map, or associative array, is a variable v formatted as
+
+        size, name, type, cap, count, used, end, last, slot1, ..., slotcap, ...
+
+    where type is VAR_MAP|VAR_NUM or VAR_MAP|VAR_STR and the slots are a
+    hash table, searched by linear probing, of the offsets from v of the
+    entries, 0 meaning an empty slot: count is the number of keys and used
+    that of non empty slots, out of the cap ones. Entries are stored from
+    the offset end on, up to the end of the variable, in the form
+
+        flag, key, value
+
+    where flag is 0 if the key has been deleted, key is a C-string and value
+    a number or a C-string: entries are never moved but when the map is
+    rebuilt, thus a deleted key is still found if any != 0, so that keys
+    can be iterated while they are deleted. Last is the slot of the key
+    accessed by var_address, whose value is going to be assigned.
+
+    Return the slot of the key p[0:len] in v, or -1 - i, if it is missing
+    and i is the slot where it would be inserted. */
+long map_find(addr_t v, const char *p, size_t len, int any) {
+    unsigned mask = PEEK(MAP_CAP(v)) - 1, i = map_hash(p, len) & mask;
+    for (addr_t e; (e = PEEK(MAP_SLOT(v, i))) != 0; i = (i + 1) & mask) {
+        const char *key = RAM + v + e + 1;
+        if ((any || RAM[v + e]) && strncmp(key, p, len) == 0 && key[len] == 0)
+            return i;
+    }
+    return -1 - (long)i;
+}
+
+/// Return the address of the value of the key in the slot i of the map v.
+addr_t map_value(addr_t v, int i) {
+    addr_t e = v + PEEK(MAP_SLOT(v, i)) + 1;
+    return e + strlen(RAM + e) + 1;
+}
+
+/** Rebuild the map v with the slots for a key more and room for an entry
+    of need bytes, at least, dropping deleted and overwritten entries: its
+    size changes, so that the following variables are shifted. */
+void map_rebuild(addr_t v, int need) {
+    extern num_t *mat_spare(size_t);
+    int type = VAR_TYPE(v), cap = PEEK(MAP_CAP(v)), count = 0, cap_new;
+    long live = 0;
+    for (int i = 0; i < cap; ++ i) {
+        addr_t e = PEEK(MAP_SLOT(v, i));
+        if (e != 0 && RAM[v + e]) {
+            live += map_entry_size(v + e, type);
+            ++ count;
+    }}
+    /*  Slots are at most half used and the entries take up to 2/3 of their
+        room, or, if there is not enough memory, slots are at most 3/4 used
+        and there is no room to spare. */
+    long end, size, delta;
+    for (int tight = 0; ; ++ tight) {
+        if (tight == 2) ERROR(OUT_OF_VARIABLES);
+        for (cap_new = MAP_SLOTS; tight ? (count + 1) * 4 > cap_new * 3
+                                        : (count + 1) * 2 > cap_new; )
+            cap_new *= 2;
+        end = MAP_SLOT(0, cap_new);
+        size = VAR_ALIGNED(end + live + need + (tight ? 0 : (live + need) / 2));
+        delta = size - VAR_SIZE(v);
+        if (size <= 0xFFFF && delta < rt.sp0 - rt.vp) break;
+    }
+    // The new map is built in a buffer, at offset 0.
+    byte_t *t = (byte_t*)mat_spare((size + sizeof(num_t) - 1) / sizeof(num_t));
+    memset(t, 0, size);
+    memcpy(t, RAM + v, VAR_HEAD);
+    poke(t, size);
+    poke(t + MAP_CAP(0), cap_new);
+    poke(t + MAP_COUNT(0), count);
+    poke(t + MAP_USED(0), count);
+    for (int i = 0; i < cap; ++ i) {
+        addr_t e = PEEK(MAP_SLOT(v, i));
+        if (e == 0 || RAM[v + e] == 0) continue;
+        const char *key = RAM + v + e + 1;
+        unsigned j = map_hash(key, strlen(key)) & (cap_new - 1);
+        while (peek(t + MAP_SLOT(0, j)) != 0) j = (j + 1) & (cap_new - 1);
+        poke(t + MAP_SLOT(0, j), end);
+        int n = map_entry_size(v + e, type);
+        memcpy(t + end, RAM + v + e, n);
+        end += n;
+    }
+    poke(t + MAP_END(0), end);
+    // Grow v before copying the new map, shrink it after.
+    addr_t next = v + VAR_SIZE(v);
+    if (delta > 0) memmove(RAM + next + delta, RAM + next, rt.vp - next);
+    memcpy(RAM + v, t, size);
+    if (delta < 0) memmove(RAM + next + delta, RAM + next, rt.vp - next);
+    rt.vp += delta;
+    var_moved(next, delta);
+}
+
+/** Return the slot of the key p[0:len] in the map v, inserting it with a
+    null value if it is missing: p should not be inside the variable area. */
+int map_insert(addr_t v, const char *p, size_t len) {
+    long i = map_find(v, p, len, 0);
+    if (i >= 0) return i;
+    int n = 1 + len + 1 + (VAR_TYPE(v) & VAR_NUM ? sizeof(num_t) : 1);
+    if (PEEK(MAP_END(v)) + n > VAR_SIZE(v)
+    ||  (PEEK(MAP_USED(v)) + 1) * 4 > PEEK(MAP_CAP(v)) * 3) {
+        map_rebuild(v, n);
+        i = map_find(v, p, len, 0);
+    }
+    i = -1 - i;
+    addr_t e = v + PEEK(MAP_END(v));
+    RAM[e] = 1;
+    memcpy(RAM + e + 1, p, len);
+    memset(RAM + e + 1 + len, 0, n - 1 - len);
+    POKE(MAP_SLOT(v, i), e - v);
+    POKE(MAP_END(v), e - v + n);
+    POKE(MAP_COUNT(v), PEEK(MAP_COUNT(v)) + 1);
+    POKE(MAP_USED(v), PEEK(MAP_USED(v)) + 1);
+    return i;
+}
+
+/// Parse a key "(s)" at IP and return it.
+str_t map_key(void) {
+    extern str_t expr_str(void);
+    EXPECT('(', SUBSCRIPT);
+    str_t s = expr_str();
+    EXPECT(')', OPENPAR_WITHOUT_CLOSEPAR);
+    if (RAM[s] == '\0') ERROR(KEY);
+    return s;
+}
+
+/** Parse the key of the map v, inserting it if missing, store the address of
+    its value into *va and return the type of the value. */
+int map_address(addr_t v, addr_t *va) {
+    str_t s = map_key();
+    int i = map_insert(v, RAM + s, strlen(RAM + s));
+    POKE(MAP_LAST(v), i);
+    *va = map_value(v, i);
+    return VAR_TYPE(v) & (VAR_NUM|VAR_STR);
+}
+
+/** Parse the key of the map v, whose name is at IP, and push its value, or
+    0 or the empty string if the key is missing: the map is not changed. */
+void map_get(addr_t v) {
+    IP += 1 + sizeof(addr_t);
+    str_t s = map_key();
+    long i = map_find(v, RAM + s, strlen(RAM + s), 0);
+    if (VAR_TYPE(v) & VAR_NUM) {
+        push_num(i < 0 ? 0 : PEEK_NUM(map_value(v, i)));
+    } else {
+        addr_t va = i < 0 ? s + strlen(RAM + s) : map_value(v, i);
+        push_str(cstr_add_temp(RAM + va, strlen(RAM + va)));
+}}
+
+/** Assign to the string value at va of the map v, accessed last by
+    var_address, the len characters at p: if they don't fit into the old
+    value, the entry is copied at the end of the map. */
+void map_assign(addr_t v, addr_t va, const char *p, unsigned len) {
+    if (len > strlen(RAM + va)) {
+        int i = PEEK(MAP_LAST(v));
+        addr_t e = v + PEEK(MAP_SLOT(v, i));
+        int klen = va - e - 2, n = 1 + klen + 1 + len + 1;
+        if (PEEK(MAP_END(v)) + n > VAR_SIZE(v)) {
+            str_t key = cstr_add_temp(RAM + e + 1, klen);
+            map_rebuild(v, n);
+            i = map_find(v, RAM + key, klen, 0);
+            e = v + PEEK(MAP_SLOT(v, i));
+        }
+        addr_t f = v + PEEK(MAP_END(v));
+        memcpy(RAM + f, RAM + e, 1 + klen + 1);
+        POKE(MAP_SLOT(v, i), f - v);
+        POKE(MAP_END(v), f - v + n);
+        va = f + 1 + klen + 1;
+    }
+    memcpy(RAM + va, p, len);
+    RAM[va + len] = '\0';
+}
+
+/** Parse the key of the map v, whose name is at IP, and delete it: if no key
+    is specified then all keys are deleted. */
+void map_delete(addr_t v) {
+    IP += 1 + sizeof(addr_t);
+    if (CODE != '(') {
+        int cap = PEEK(MAP_CAP(v));
+        memset(RAM + MAP_SLOT(v, 0), 0, cap * sizeof(addr_t));
+        POKE(MAP_COUNT(v), 0);
+        POKE(MAP_USED(v), 0);
+        POKE(MAP_END(v), MAP_SLOT(v, cap) - v);
+        return;
+    }
+    str_t s = map_key();
+    long i = map_find(v, RAM + s, strlen(RAM + s), 0);
+    if (i >= 0) {
+        RAM[v + PEEK(MAP_SLOT(v, i))] = 0;
+        POKE(MAP_COUNT(v), PEEK(MAP_COUNT(v)) - 1);
+}}
+
+/** Parse "(m, s)", where m is the name of a map and s a key, and push the
+    next key of m after s, in the order of the slots, or the empty string if
+    there is none: if s is the empty string the first key is pushed. */
+void map_next(void) {
+    extern str_t expr_str(void);
+    EXPECT('(', OPENEDPAR);
+    if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
+    addr_t v = var_find(PEEK(IP + 1));
+    if (v == NIL) ERROR(UNDEFINED_VARIABLE);
+    if (!(VAR_TYPE(v) & VAR_MAP)) ERROR(MAP);
+    IP += 1 + sizeof(addr_t);
+    EXPECT(',', COMMA);
+    str_t s = expr_str();
+    EXPECT(')', CLOSEDPAR);
+    long i = -1;
+    if (RAM[s] != '\0') {
+        i = map_find(v, RAM + s, strlen(RAM + s), 1);
+        if (i < 0) ERROR(KEY);
+    }
+    int cap = PEEK(MAP_CAP(v));
+    for (++ i; i < cap; ++ i) {
+        addr_t e = PEEK(MAP_SLOT(v, i));
+        if (e != 0 && RAM[v + e]) {
+            s = v + e + 1;
+            break;
+    }}
+    if (i == cap) s += strlen(RAM + s);
+    push_str(cstr_add_temp(RAM + s, strlen(RAM + s)));
+}
+
+/// Print the size and some keys of the map v.
+void map_dump(addr_t v) {
+    int cap = PEEK(MAP_CAP(v)), count = PEEK(MAP_COUNT(v)), n = 0;
+    fprintf(rt_msg(), "(MAP) = %i KEYS, LOAD %i%%, %i BYTES |", count,
+        100 * PEEK(MAP_USED(v)) / cap, VAR_SIZE(v));
+    for (int i = 0; i < cap; ++ i) {
+        addr_t e = PEEK(MAP_SLOT(v, i));
+        if (e == 0 || RAM[v + e] == 0) continue;
+        if (n ++ == 3) { fputs(" ...", rt.msg); break; }
+        fprintf(rt.msg, " \"%s\"=", RAM + v + e + 1);
+        if (VAR_TYPE(v) & VAR_NUM) fprintf(rt.msg, "%g", PEEK_NUM(map_value(v, i)));
+        else fprintf(rt.msg, "\"%s\"", RAM + map_value(v, i));
+    }
+    fputs(" |\n", rt.msg);
+}
+
 /** Parse a variable, whose name (the CODE_IDN(S)) is pointed by IP and whose
     address in the variable's list is v, returning in *va the address of the
     value pointed by the variable expression (e.g. a$(1) points to the
@@ -1027,7 +2326,9 @@ int var_array_address(int type, addr_t p, addr_t *a1) {
 int var_address(addr_t v, addr_t *va) {
     IP += 1 + sizeof(addr_t);           // Skip the variable's name
     int type = VAR_TYPE(v);
-    if (type & (VAR_VEC|VAR_MAT)) {
+    if (type & VAR_MAP) {
+        type = map_address(v, va);
+    } else if (type & (VAR_VEC|VAR_MAT)) {
         type = var_array_address(type, VAR_ADDR(v), va);
     } else {
         *va = VAR_ADDR(v);              // Scalar or FOR variable: return it!
@@ -1066,6 +2367,11 @@ Again:; // Tail recursion goto target.
     // Check against a built-in function or non infix operator.
     if (code >= 0 && CODE < CODE_ENDOPERATOR && !Operators[code].infix) {
         ++ IP;  // Skip the operator.
+        // Operators on arrays parse their own parameters.
+        if (Operators[code].arity == ARRAY_ARGS) {
+            (*Operators[code].routine)();
+            return 0;
+        }
         // Execute operators on the stack with higher priority
         rt_epop(Operators[code].priority);
         // Push the operator on the stack.
@@ -1106,6 +2412,7 @@ void expr_operand(void) {
         str_t name = PEEK(IP + 1);
         addr_t v = var_find(name);
         if (v == NIL) { if (!fn_eval(name)) ERROR(UNDEFINED_VARIABLE); }
+        else if (VAR_TYPE(v) & VAR_MAP) map_get(v);
         else {
             addr_t va;
             var_address(v, &va);
@@ -1195,25 +2502,27 @@ Again:
     To assign a number value use poke_num!!! */
 /// \{
 
+/** Assign to the string variable v the len characters at p, which should not
+    be inside the variable area: the address of the string to overwrite is
+    expected in va, while v contains the first byte of the variable in the
+    variable's list (its size field). */
+void assign_chars(addr_t v, str_t va, const char *p, unsigned len) {
+    // va points to the first character of the string to overwrite with p.
+    if (VAR_TYPE(v) & VAR_MAP) { map_assign(v, va, p, len); return; }
+    unsigned len_v = strlen(RAM + va) + 1;
+    unsigned len_s = len + 1;
+    // Reduce/Augment the space for the string.
+    if (len_s != len_v) var_resize(v, va, len_v, len_s);
+    // Finally copy p on string va.
+    memcpy(RAM + va, p, len);
+    RAM[va + len] = '\0';
+}
+
 /** Assign to the string variable v the string s: the address of the string to
     overwrite is expected in va, while v contains the first byte of the variable
     in the variable's list (its size field). */
 void assign_string(addr_t v, str_t va, str_t s) {
-    // va points to the first character of the string to overwrite with s.
-    unsigned len_v = strlen(RAM + va) + 1;
-    unsigned len_s = strlen(RAM + s) + 1;
-    int delta = len_s - len_v;  // Shall increase the length of v by delta.
-    if (delta >= rt.sp0 - rt.vp) ERROR(OUT_OF_VARIABLES);
-    if (delta != 0) {
-        // Reduce/Augment the space for the string.
-        memmove(RAM + va + len_s, RAM + va + len_v, rt.vp - (va + len_v));
-        // Adjust the pointer to the first free byte in the variable area.
-        rt.vp += delta;
-        // Adjust the size of the variable containing the string.
-        POKE(v, PEEK(v) + delta);
-    }
-    // Finally copy string s on string va.
-    strcpy(RAM + va, RAM + s);
+    assign_chars(v, va, RAM + s, strlen(RAM + s));
 }
 
 /** Parse "= expr" and assign the value to the variable of given type, at
@@ -1229,43 +2538,53 @@ void assign_expr(int type, addr_t v, addr_t va) {
         assign_string(v, va, pop_str());
 }}
 
-/** Scan buffer b matching a constant (number, comma ending string or string
-    delimited by double quotes) to the variable at IP: if no error occurs,
-    assigns to the parsed variable the a value scanned from b. The updated
-    pointer to the buffer is returned, pointing to ',' or '\0': if neither ','
-    nor '\0' is found after the constant, NIL is returned. */
-addr_t assign_item(addr_t b) {
-    // We'll use C string standard functions.
-    byte_t *p = RAM + b;
-    byte_t *p1;
-    addr_t v = var_insert(IP + 1);
-    addr_t va;
-    int type = var_address(v, &va);
-    p += strspn(p, " \t\r\f\n");    // skip blanks
+/** Scan the characters p[0:end-p] matching a constant (number, comma ending
+    string or string delimited by double quotes) and assign the value to the
+    item at va, of the given type, of variable v. The characters are not
+    changed, and *end should not be part of a number (as '\0' or '\n' is).
+    The updated pointer is returned, pointing to ',' or to end: if neither
+    ',' nor end is found after the constant, NULL is returned. */
+const char *assign_value(int type, addr_t v, addr_t va,
+                         const char *p, const char *end) {
+    const char *p1;
+    while (p < end && strchr(" \t\r\f\n", *p) != NULL) ++ p;  // Skip blanks.
     if (type & (VAR_NUM|VAR_FOR)) {
-        p1 = p;
-        num_t n = strtod((char*)p1, (char**)&p);
-        if (p1 == p) ERROR(ILLEGAL_INPUT);
+        char *p2;
+        if (p == end) ERROR(ILLEGAL_INPUT);
+        num_t n = strtod(p, &p2);
+        if (p2 == p) ERROR(ILLEGAL_INPUT);
         POKE_NUM(va, n);
-    } else if (*p == '"') {
+        p = p2;
+    } else if (p < end && *p == '"') {
         // String between double quotes.
         ++ p;
-        if ((p1 = strchr(p, '"')) == NULL) ERROR(EOL_INSIDE_STRING);
-        // assign_string expects a C-string.
-        *p1 = '\0'; assign_string(v, va, p - RAM); *p1 = '"';
+        if ((p1 = memchr(p, '"', end - p)) == NULL) ERROR(EOL_INSIDE_STRING);
+        assign_chars(v, va, p, p1 - p);
         p = p1 + 1;
     } else {
         // String ending with the line or the next comma.
-        if ((p1 = strchr(p, ',')) == NULL) {
-            assign_string(v, va, p - RAM);
-            p += strlen(p);
-        } else {
-            // Transform the ',' into '\0' to get a C-string.
-            *p1 = '\0'; assign_string(v, va, p - RAM); *p1 = ',';
-            p = p1;
-    }}
-    p += strspn(p, " \t\r\f\n");    // skip blanks
-    return (*p == ',' || *p == '\0') ? p - RAM : NIL;
+        if ((p1 = memchr(p, ',', end - p)) == NULL) p1 = end;
+        assign_chars(v, va, p, p1 - p);
+        p = p1;
+    }
+    while (p < end && strchr(" \t\r\f\n", *p) != NULL) ++ p;  // Skip blanks.
+    return (p == end || *p == ',') ? p : NULL;
+}
+
+/** Scan the characters p[0:end-p] as assign_value does, assigning the value
+    to the variable at IP. */
+const char *assign_scan(const char *p, const char *end) {
+    addr_t v = var_insert(IP + 1);
+    addr_t va;
+    int type = var_address(v, &va);
+    return assign_value(type, v, va, p, end);
+}
+
+/** Scan the C-string at b as assign_scan does: the updated address of the
+    string is returned, or NIL if no ',' or '\0' is found after the constant. */
+addr_t assign_item(addr_t b) {
+    const char *p = assign_scan(RAM + b, RAM + b + strlen(RAM + b));
+    return p == NULL ? NIL : (byte_t*)p - RAM;
 }
 
 /// \}
@@ -1275,7 +2594,7 @@ addr_t assign_item(addr_t b) {
 /** Print a token at address a on file f: return the address of next token
     or NIL if the printed token is '\0' (the end of the line). */
 addr_t token_dump(addr_t a, FILE *f) {
-    static int space = 0;   // 1 if a space should be printed in advance.
+    static _Thread_local int space = 0; // 1 if a space should be printed in advance.
     byte_t b = RAM[a];
     if (b == 0) {
         space = 0;
@@ -1313,9 +2632,9 @@ addr_t token_dump(addr_t a, FILE *f) {
         space = 1;
     } else if (b > CODE_STARTKEYWORD && b < CODE_ENDKEYWORD) {
         if (space) fputc(' ', f);
-        if (f == stderr) fputs("\033[1m", stderr);  // Bold blue
+        if (f == rt.msg) fputs("\033[1m", rt.msg);  // Bold blue
         fprintf(f, "%s", Keywords[b - CODE_STARTKEYWORD - 1]);
-        if (f == stderr) fputs("\033[22m", stderr);  // Not bold
+        if (f == rt.msg) fputs("\033[22m", rt.msg);  // Not bold
         if (b == CODE_DATA || b == CODE_REM) {
             fputs(RAM + a, f);
             a += strlen(RAM + a);   // points to the ending '\0'
@@ -1355,11 +2674,19 @@ int token_operator(char *p0, unsigned len) {
     return 0;
 }
 
+/** If IP points to the identifier w, used as a context word as in DIM A(MAP)
+    or SORT A DESC, skip it and return 1, else return 0. */
+int token_word(const char *w) {
+    if (CODE != CODE_IDN || strcmp(RAM + PEEK(IP + 1), w) != 0) return 0;
+    IP += 1 + sizeof(addr_t);
+    return 1;
+}
+
 ///  Tokenize the contents of buf[0] and store it at obj: return 0 on error.
 int tokenize(void) {
     int k, len;
     // Encode the buf[0] string at obj.
-    byte_t *p = RAM + rt.buf[0];
+    byte_t *p = RAM + rt.buf;
     byte_t *q0 = RAM + rt.obj; // The line size will be stored here.
     byte_t *q = q0 + 1;         // The line will be stored here.
     byte_t b;
@@ -1367,7 +2694,7 @@ int tokenize(void) {
         p += strspn(p, " \t");  // Skip blanks.
         if (*p < 32) ++ p;      // Skip non printable
         else if (*p > 127) {
-            printf("SKIP INVALID ASCII CODE %i\n", *p);
+            fprintf(rt.out, "SKIP INVALID ASCII CODE %i\n", *p);
             ++ p;
         } else if (isdigit(*p) || *p == '.' && isdigit(p[1])) {
             char *p1, *p2;
@@ -1411,7 +2738,7 @@ int tokenize(void) {
                 // constants list, add it.
                 if ((k = cstr_find(q, len)) < 0
                 && (k = cstr_add(q, len)) < 0) {
-                    puts(Errors[ERROR_OUT_OF_STRINGS]);
+                    fprintf(rt.out, "%s\n", Errors[ERROR_OUT_OF_STRINGS]);
                     return 0;
                 }
                 // An identifier is stored as 3 bytes: code, address in constant
@@ -1429,12 +2756,12 @@ int tokenize(void) {
         } else if (*p == '"') {
             len = strcspn(++p, "\"");
             if (p[len] != '"') {
-                puts(Errors[ERROR_EOL_INSIDE_STRING]);
+                fprintf(rt.out, "%s\n", Errors[ERROR_EOL_INSIDE_STRING]);
                 return 0;
             }
             if ((k = cstr_find(p, len)) < 0
             && (k = cstr_add(p, len)) < 0) {
-                puts(Errors[ERROR_OUT_OF_STRINGS]);
+                fprintf(rt.out, "%s\n", Errors[ERROR_OUT_OF_STRINGS]);
                 return 0;
             }
             *q = CODE_STRLIT;
@@ -1496,14 +2823,14 @@ extern int instr_exec(void);
 
 /** If there are unsaved changes in the current program, ask the user if they
     could be discarded: return 1 if there are no changes or the user agree to
-    discard them, else return 0. */
+    discard them, else return 0. A host program is never asked. */
 int prog_check(void) {
     int ok = 1;
-    if (rt.prog_changed) {
+    if (rt.prog_changed && !rt.hosted) {
         fputs("\nUNSAVED CHANGES IN CURRENT PROGRAM: DISCARD THEM (Y/N)? ",
-            stderr);
+            rt_msg());
         char c[2];
-        fgets(c, sizeof(c), stdin);
+        fgets(c, sizeof(c), rt.in);
         if (toupper(*c) != 'Y') ok = 0;
     }
     return ok;
@@ -1521,6 +2848,7 @@ int prog_delete(int n) {
             // Adjust pointers.
             rt.pp -= size;
             rt.prog_changed = 1;
+            rt_forget();
             return 0;
     }}
     return 1;
@@ -1536,7 +2864,7 @@ void prog_edit(addr_t line) {
     } else {
         if (RAM[LINE_TEXT(line)] == 0) {
             if (prog_delete(line_no))
-                printf("LINE %i DOES NOT EXIST!\n", line_no);
+                fprintf(rt.out, "LINE %i DOES NOT EXIST!\n", line_no);
         } else {
             // Overwrite (= delete + insert) the line.
             prog_delete(line_no);
@@ -1545,13 +2873,24 @@ void prog_edit(addr_t line) {
 
 /// Execute the current program until an error occurs.
 void prog_exec(void) {
+    extern void prog_continue(void);
     rt.ip0 = rt.pp0;
     LINE_START;
-    srand(0);   // makes RND deterministic by default.
+    rt_srand(0);    // makes RND deterministic by default.
+    prog_continue();
+}
+
+/** Execute the current program from IP until an error occurs: used to run
+    it and to resume it from a checkpoint. */
+void prog_continue(void) {
     //~ while (rt.ip0 < rt.pp && !instr_exec())
     while (IP != NIL && !instr_exec())
         ;
-    if (IP != NIL) puts("instr_exec() FAILED!");
+    extern void chan_flush_all(void);
+    chan_flush_all();   // Output files are written at the end.
+    term_buffer(0);     // The screen buffer doesn't survive the program.
+    kbd_restore();      // Neither the raw keyboard mode.
+    if (IP != NIL) fputs("instr_exec() FAILED!\n", rt.out);
 }
 
 /** Looks for a line with line number n: if found then its address is returned,
@@ -1583,6 +2922,7 @@ void prog_insert(int n, addr_t a) {
         // Adjust pointers.
         rt.pp += size_new;
         rt.prog_changed = 1;
+        rt_forget();
 }}
 
 /// Load a program with the given file name and return the value of rt.error.
@@ -1616,10 +2956,11 @@ void prog_print(FILE *f) {
 int prog_repl(FILE *f) {
     while (!feof(f)) {
         rt.ip0 = rt.obj;    // In case rt_ctrlbreak is called!
-        if (f == stdin) putchar('>');
-        if (fgets(RAM + rt.buf[0], BUF_SIZE, f) == NULL) break;
+        if (f == rt.in) term_putc('>');
+        if (fgets(RAM + rt.buf, BUF_SIZE, f) == NULL) break;
+        if (f == rt.in && !rt.batch) term_newline();
         // Drop the final '\n' from the string.
-        char *p = strchr(RAM + rt.buf[0], '\n');
+        char *p = strchr(RAM + rt.buf, '\n');
         if (p != NULL) *p = '\0';
         tokenize();
         // RAM[rt.obj] is reserved to contain the line size.
@@ -1629,6 +2970,8 @@ int prog_repl(FILE *f) {
             IP = rt.obj + 1;    // First token of the line after the size byte.
             while (IP != NIL && CODE != 0 && !instr_exec())
                 ;
+            term_refresh();
+            kbd_restore();
     }}
     return rt.error;
 }
@@ -1645,292 +2988,1784 @@ void prog_save(char *name) {
 }}
 
 /// \}
-/// \defgroup INSTR Instruction Implementation
+/** \defgroup CHAN Channels
+
+    A channel is a FILE handle, but regular files opened for input, which are
+    mapped in memory, so that lines are found by memchr (which is vectorized
+    by any decent C library) and parsed in place, without any length limit.
+    Other input files are read by lines into the channel's buffer, unless
+    they are opened in read-ahead mode: in this case a thread reads them in
+    large blocks while the program goes on, and lines are parsed in place
+    from those blocks.
+
+    A channel may also be a pipe from or to a process running a command,
+    which is waited for when the channel is closed.
+
+    Binary files are accessed by records of fixed length, which are read and
+    written at their offset in the file by pread and pwrite, so that no
+    buffering is involved.
+
+    Output files are written behind: what is printed on them is collected
+    in large buffers, which a thread writes on the file while the program
+    goes on. Data are surely written only after FLUSH, CLOSE or the end of
+    the program: write errors are detected at that time, or by the first
+    PRINT following them. */
 /// \{
 
-/** Parse a possible channel and return its number. FILE file0 is assigned
-    to the 0 channel if #0 is parsed. The channel is checked to be busy, else
-    an error is issued. */
-int instr_channel(FILE *file0) {
-    int ch = 0; // a priori buffer #0
-    rt.channels[ch] = file0;
-    if (CODE == '#') {
-        ++ IP;
-        ch = expr_num();     // Parse the channel number.
-        if (rt.channels[ch] == NULL) ERROR(CHANNEL_CLOSED);
-        EXPECT(',', COMMA);
+/** Check that ch is the number of an opened channel and return it: raise
+    an error if it is not. */
+int chan_opened(int ch) {
+    if (ch < 0 || ch >= rt.chan_max) ERROR(ILLEGAL_CHANNEL);
+    if (ch >= rt.chan_num || rt.chan[ch].file == NULL) ERROR(CHANNEL_CLOSED);
+    return ch;
+}
+
+/** Check that ch is the number of a free channel, other than 0, and return
+    it: the channel table is enlarged to contain it, if needed. */
+int chan_free(int ch) {
+    if (ch < 1 || ch >= rt.chan_max) ERROR(ILLEGAL_CHANNEL);
+    if (ch >= rt.chan_num) {
+        int n = ch + 1 > 2 * rt.chan_num ? ch + 1 : 2 * rt.chan_num;
+        if (n > rt.chan_max) n = rt.chan_max;
+        chan_t *chan = realloc(rt.chan, n * sizeof(chan_t));
+        if (chan == NULL) ERROR(ILLEGAL_CHANNEL);
+        memset(chan + rt.chan_num, 0, (n - rt.chan_num) * sizeof(chan_t));
+        rt.chan = chan;
+        rt.chan_num = n;
     }
+    if (rt.chan[ch].file != NULL) ERROR(CHANNEL_BUSY);
+    rt.chan[ch].bytes = rt.chan[ch].lines = 0;
     return ch;
 }
 
-/** Advance IP to the first token of the next instruction: if needed, IP is
-    advanced to the first instruction of the next line, if any. The updated
-    value of IP is returned, unless no further instruction is available, in
-    which case NIL is returned. */
-addr_t instr_skip(void) {
-    /*  If RAM[ip] == 0 then the current line is ended, so ip+1 points to
-        the next one; if RAM[ip] == ':' then ip+1 points to the next
-        instruction. */
-    while (CODE != 0) {
-        if (CODE == ':' || CODE == CODE_THEN) return ++IP;
-        IP = token_skip(IP);
+/** Write-behind buffers of an output file: while the interpreter fills
+    buf[active], a writer thread writes buf[!active] on the file if busy is
+    set. The errno of the first failed write is kept in error. */
+typedef struct wbuf {
+    int fd, active, busy, quit, error;
+    char *buf[2];
+    size_t len[2];
+    unsigned long bytes, lines;     ///< Data written so far.
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wbuf_t;
+
+/// Writer thread of an output file.
+void *wb_writer(void *arg) {
+    wbuf_t *w = arg;
+    // Signals are for the main thread, whose rt their handlers use: a pipe
+    // closed by its reader makes write fail instead of killing us.
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->busy && !w->quit) pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->busy) break;
+        int i = !w->active;
+        pthread_mutex_unlock(&w->lock);
+        for (size_t done = 0; done < w->len[i] && w->error == 0; ) {
+            ssize_t n = write(w->fd, w->buf[i] + done, w->len[i] - done);
+            if (n >= 0) done += n; else if (errno != EINTR) w->error = errno;
+        }
+        pthread_mutex_lock(&w->lock);
+        w->len[i] = 0;
+        w->busy = 0;
+        pthread_cond_broadcast(&w->cond);
     }
-    // Here we are at the end of the line.
-    rt.ip0 = IP + 1;
-    return LINE_START;
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
 }
 
-/// Advance IP to the first token of the next program's line.
-addr_t instr_skip_line(void) {
-    rt.ip0 += RAM[rt.ip0];    // Skip to the next line.
-    return LINE_START;
+/** Pass the buffer being filled to the writer thread, once it is done with
+    the other one, which is filled next: if wait != 0 then wait also for the
+    writer to finish. */
+void wb_submit(wbuf_t *w, int wait) {
+    pthread_mutex_lock(&w->lock);
+    while (w->busy) pthread_cond_wait(&w->cond, &w->lock);
+    if (w->len[w->active] > 0) {
+        w->active = !w->active;
+        w->busy = 1;
+        pthread_cond_broadcast(&w->cond);
+    }
+    while (wait && w->busy) pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
 }
 
-/** Starting from the pointer IP, looks for the instruction whose CODE is
-    code and returns the updated value of IP to the address of the token
-    following it, or NIL if no such instruction exists. */
-addr_t instr_lookfor(byte_t code) {
-    do if (CODE == code) return ++IP; while (instr_skip() != NIL);
-    return NIL;
+/// Stdio write function of an output file: fill the write-behind buffers.
+ssize_t wb_write(void *cookie, const char *p, size_t size) {
+    wbuf_t *w = cookie;
+    w->bytes += size;
+    for (const char *q = p; (q = memchr(q, '\n', p + size - q)) != NULL; ++ q)
+        ++ w->lines;
+    for (size_t n = size; n > 0; ) {
+        size_t free = WB_SIZE - w->len[w->active];
+        if (free == 0) { wb_submit(w, 0); continue; }
+        if (free > n) free = n;
+        memcpy(w->buf[w->active] + w->len[w->active], p, free);
+        w->len[w->active] += free;
+        p += free;
+        n -= free;
+    }
+    return size;
 }
 
-// Used by GOTO and ON
-void instr_goto(int line) {
-    rt.ip0 = prog_find(line);
-    LINE_START;
+/** Stdio close function of an output file: drain the buffers, stop the
+    writer thread and close the file; return -1 if any write failed. */
+int wb_close(void *cookie) {
+    wbuf_t *w = cookie;
+    wb_submit(w, 1);
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    int error = (close(w->fd) != 0) | (w->error != 0);
+    free(w->buf[0]);
+    free(w);
+    return error ? -1 : 0;
 }
 
-// Used by GOSUB and ON
-void instr_gosub(int line) {
-    rpush(rt.ip0, IP);
-    instr_goto(line);
+/** Connect the file descriptor fd, opened for writing, to channel ch with
+    write-behind buffers: return 0 on failure, closing fd. */
+int chan_behind(int ch, int fd) {
+    wbuf_t *w = calloc(1, sizeof(wbuf_t));
+    char *buf = malloc(2 * WB_SIZE);
+    cookie_io_functions_t io = { NULL, wb_write, NULL, wb_close };
+    if (w == NULL || buf == NULL) goto Error;
+    w->fd = fd;
+    w->buf[0] = buf;
+    w->buf[1] = buf + WB_SIZE;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, wb_writer, w) != 0) goto Error;
+    if ((rt.chan[ch].file = fopencookie(w, "w", io)) == NULL) {
+        wb_close(w);
+        return 0;
+    }
+    rt.chan[ch].wb = w;
+    return 1;
+Error:
+    free(buf);
+    free(w);
+    close(fd);
+    return 0;
 }
 
-void INSTR_ATTR(void) {
-    // ATTR property = value, ...
-    // where property can be: BOLD, UNDER, BACK, FORE, BRIGHT, BLINK, REVERSE
-    // values can be BOLD, UNDER, BRIGHT, BLINK = 0|1; BACK, FORE = 0,...,7
+/** Open the file name on channel ch for writing, truncating it if append is
+    0, with write-behind buffers: return 0 on failure. */
+int chan_open_output(int ch, const char *name, int append) {
+    int fd = open(name, O_WRONLY|O_CREAT|(append ? O_APPEND : O_TRUNC), 0666);
+    return fd >= 0 && chan_behind(ch, fd);
+}
+
+/** Write on the file all the output data of channel ch, waiting for the
+    writer thread to finish: raise an error if any write failed. */
+void chan_flush(int ch) {
+    fflush(ch == 0 ? rt.out : rt.chan[ch].file);
+    if (rt.chan[ch].wb != NULL) {
+        wb_submit(rt.chan[ch].wb, 1);
+        if (rt.chan[ch].wb->error) ERROR(WRITE);
+}}
+
+/// Flush all output channels, ignoring errors: used at exit.
+void chan_flush_all(void) {
+    for (int i = 1; i < rt.chan_num; ++ i)
+        if (rt.chan[i].wb != NULL) {
+            fflush(rt.chan[i].file);
+            wb_submit(rt.chan[i].wb, 1);
+}}
+
+/** Store into *bytes and *lines the amount of data read from or written on
+    channel c: for binary files, lines are records. */
+void chan_count(chan_t *c, unsigned long *bytes, unsigned long *lines) {
+    if (c->wb != NULL) fflush(c->file);     // Pass data to the write-behind.
+    *bytes = c->wb != NULL ? c->wb->bytes : c->bytes;
+    *lines = c->wb != NULL ? c->wb->lines : c->lines;
+}
+
+/** Blocks read ahead from an input file: blocks [head, tail), modulo
+    RA_BLOCKS, are filled, and the program reads from buf[head] at pos,
+    while the reader thread fills buf[tail]. Once the file is ended eof is
+    set, and error is set if the read failed. The reader is stopped by
+    setting quit and writing on the event file descriptor wake, since it may
+    be waiting for a free block or for data to read. */
+typedef struct rbuf {
+    int fd, eof, error, quit, wake;
+    unsigned head, tail;
+    size_t pos, len[RA_BLOCKS];
+    char *buf[RA_BLOCKS];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} rbuf_t;
+
+/// Reader thread of an input file.
+void *ra_reader(void *arg) {
+    rbuf_t *r = arg;
+    // Signals are for the main thread, whose rt their handlers use.
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
     for (;;) {
-        EXPECT(CODE_IDN, ILLEGAL_ATTRIBUTE);
-        char *property = RAM + PEEK(IP);
-        IP += sizeof(str_t);
-        unsigned value = 1;
-        if (CODE == CODE_EQ) {
-            ++ IP;
-            value = expr_num();
-        }
-        // What follows depends on the compliancy of the terminal with ECMA-48.
-        if (strcmp(property, "BACK") == 0)
-            printf("\033[48;2;%i;%i;%im", 255*(value&4), 255*(value&2),
-                255*(value&1));
-        else if (strcmp(property, "BLINK") == 0)
-            printf("\033[%im", 25 - 20*(value & 1));
-        else if (strcmp(property, "BOLD") == 0)
-            printf("\033[%im", 22 - 21*(value & 1));
-        else if (strcmp(property, "BRIGHT") == 0)
-            printf("\033[%im", 2 + 20*(value & 1));
-        else if (strcmp(property, "FORE") == 0)
-            printf("\033[38;2;%i;%i;%im", 255*(value&4), 255*(value&2),
-                255*(value&1));
-        else if (strcmp(property, "RESET") == 0)
-            fputs("\033[0m\033[38;2;0;255;0m\033[48;2;0;0;0m", stdout);
-        else if (strcmp(property, "REVERSE") == 0)
-            printf("\033[%im", 27 - 20*(value & 1));
-        else if (strcmp(property, "UNDER") == 0)
-            printf("\033[%im", 24 - 20*(value & 1));
-        else {
-            ERROR(ILLEGAL_ATTRIBUTE);
+        pthread_mutex_lock(&r->lock);
+        while (r->tail - r->head == RA_BLOCKS && !r->quit)
+            pthread_cond_wait(&r->cond, &r->lock);
+        int i = r->tail % RA_BLOCKS, quit = r->quit;
+        pthread_mutex_unlock(&r->lock);
+        if (quit) return NULL;
+        struct pollfd pfd[2] = { { r->fd, POLLIN, 0 }, { r->wake, POLLIN, 0 } };
+        while (poll(pfd, 2, -1) < 0 && errno == EINTR)
+            ;
+        if (pfd[1].revents != 0) return NULL;
+        ssize_t n;
+        do n = read(r->fd, r->buf[i], RA_SIZE); while (n < 0 && errno == EINTR);
+        pthread_mutex_lock(&r->lock);
+        if (n > 0) {
+            r->len[i] = n;
+            ++ r->tail;
+        } else {
+            r->eof = 1;
+            r->error = n < 0;
         }
-        fflush(stdout);
-        if (CODE != ',') break;
-        ++ IP;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        if (n <= 0) return NULL;
 }}
 
-void INSTR_BYE(void) {
-    if (prog_check()) {
-        puts("BYE.");
-        exit(EXIT_SUCCESS);
-}}
+/** Wait until some data can be read from block head, giving back the blocks
+    completely read to the reader thread: return 0 if the file is ended. */
+int ra_ready(rbuf_t *r) {
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        if (r->head != r->tail) {
+            if (r->pos < r->len[r->head % RA_BLOCKS]) break;
+            ++ r->head;
+            r->pos = 0;
+            pthread_cond_broadcast(&r->cond);
+        } else if (r->eof) {
+            break;
+        } else {
+            pthread_cond_wait(&r->cond, &r->lock);
+    }}
+    int ready = r->head != r->tail;
+    pthread_mutex_unlock(&r->lock);
+    if (!ready && r->error) ERROR(ILLEGAL_INPUT);
+    return ready;
+}
 
-void INSTR_CHAIN(void) {
-    // CHAIN filename[,linenumber]
-    str_t name = expr_str();
-    int line = LINE_MIN - 1;
-    if (CODE == ',') {
-        ++ IP;
-        line = expr_num();
+/** Connect the file f, opened for reading, to channel ch with a thread that
+    reads it ahead: return 0 on failure, closing f. */
+int chan_ahead(int ch, FILE *f) {
+    if ((rt.chan[ch].file = f) == NULL) return 0;
+    rbuf_t *r = calloc(1, sizeof(rbuf_t));
+    char *buf = malloc(RA_BLOCKS * RA_SIZE);
+    int wake = eventfd(0, EFD_CLOEXEC);
+    if (r == NULL || buf == NULL || wake < 0) goto Error;
+    r->fd = fileno(rt.chan[ch].file);
+    r->wake = wake;
+    for (int i = 0; i < RA_BLOCKS; ++ i) r->buf[i] = buf + i * RA_SIZE;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, ra_reader, r) == 0) {
+        rt.chan[ch].ra = r;
+        return 1;
     }
-    rt_reset(RT_RESET_PROG);
-    if (prog_load(RAM + name)) ERROR(FILE);
-    // Get to the first line to execute.
-    if (line >= LINE_MIN) instr_goto(line); else prog_exec();
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+Error:
+    if (wake >= 0) close(wake);
+    free(buf);
+    free(r);
+    fclose(rt.chan[ch].file);
+    rt.chan[ch].file = NULL;
+    return 0;
 }
 
-void INSTR_CLEAR(void) {
-    // CLEAR [[s][,p]]
-    // s = space for strings, p = space for program (in byte).
-    // Get current values both for s and p.
-    int s0 = rt.pp0, s = s0;   // s0 - 0 = current space for strings.
-    int p0 = rt.vp0 - rt.pp0, p = p0;
-    // In any case, delete all variables.
-    rt.vp = rt.vp0;
-    if (CODE == CODE_INTLIT) {
-        s = PEEK(IP + 1);
-        IP += 1 + sizeof(addr_t);
+/** Open the file name on channel ch for reading, with a thread that reads
+    it ahead: return 0 on failure. */
+int chan_open_ahead(int ch, const char *name) {
+    return chan_ahead(ch, fopen(name, "r"));
+}
+
+/** Run the shell command cmd with its standard output connected to channel
+    ch if output is 0, else with its standard input: return 0 on failure.
+    The pipe is read ahead or written behind as files are. */
+int chan_open_pipe(int ch, const char *cmd, int output) {
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) != 0) return 0;
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The child's end of the pipe loses O_CLOEXEC by dup2.
+        dup2(fd[!output], !output);
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        _exit(127);
     }
-    if (CODE == ',') {
-        ++ IP;
-        EXPECT(CODE_INTLIT, VALUE);
-        p = PEEK(IP);
-        IP += sizeof(addr_t);
+    close(fd[!output]);
+    if (pid < 0) {
+        close(fd[output]);
+        return 0;
     }
-    if (s != s0 || p != p0) {
-        rt.pp0 = rt.pp = s;
-        rt.vp0 = rt.vp = s + p;
-        IP = NIL;        
-}}
+    int ok;
+    if (output) {
+        ok = chan_behind(ch, fd[1]);
+    } else {
+        FILE *f = fdopen(fd[0], "r");
+        if (f == NULL) close(fd[0]);
+        ok = chan_ahead(ch, f);
+    }
+    if (!ok) {
+        waitpid(pid, NULL, 0);
+        return 0;
+    }
+    rt.chan[ch].pid = pid;
+    return 1;
+}
 
-void INSTR_CLOSE(void) {
-    // CLOSE channel
-    int ch = expr_num();
-    if (ch < 1 || ch > BUF_NUM) ERROR(ILLEGAL_CHANNEL);
-    if (rt.channels[ch] == NULL) ERROR(CHANNEL_CLOSED);
-    fclose(rt.channels[ch]);
-    rt.channels[ch] = NULL;
+/** Convert a status returned by wait into an exit status, as the shell does:
+    128 plus the signal number for a process killed by a signal. */
+int chan_status(int status) {
+    if (status == -1) return -1;
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
 }
 
-void INSTR_CLS(void) { fputs("\033[2J\033[1;1f", stderr); }
-void INSTR_DATA(void) { instr_skip_line(); }
-void INSTR_DEF(void) { instr_skip_line(); }
+/// Return the size in bytes of the file opened on channel ch.
+off_t chan_size(int ch) {
+    struct stat st;
+    if (rt.chan[ch].map != NULL) return rt.chan[ch].size;
+    fflush(rt.chan[ch].file);
+    return fstat(fileno(rt.chan[ch].file), &st) == 0 ? st.st_size : 0;
+}
 
-void INSTR_DIM(void) {
-    for (;;) {
-        if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
-        str_t name = PEEK(IP + 1);
-        if (var_find(name) != NIL) ERROR(VARIABLE_ALREADY_DEFINED);
-        addr_t d1, d2;
-        int type = var_array_parse(&name, &d1, &d2);
-        var_create(name, type, d1, d2, 0, 0, 0);
-        if (CODE != ',') break;
+/** Open the file name on channel ch for reading and writing records of reclen
+    bytes, creating it if needed: return 0 on failure. */
+int chan_open_binary(int ch, const char *name, int reclen) {
+    int fd = open(name, O_RDWR|O_CREAT, 0666);
+    if (fd < 0) return 0;
+    if ((rt.chan[ch].file = fdopen(fd, "r+")) == NULL) {
+        close(fd);
+        return 0;
+    }
+    rt.chan[ch].reclen = reclen;
+    rt.chan[ch].pos = 0;
+    return 1;
+}
+
+/** Parse the number of a record of the binary file on channel ch, followed
+    by a comma: if the number is omitted, the next record is used. Return
+    the offset of the record, and make the following one the next record. */
+off_t chan_record(int ch) {
+    if (rt.chan[ch].reclen == 0) ERROR(ILLEGAL_MODE);
+    if (CODE != ',') {
+        num_t n = expr_num();
+        if (n < 1) ERROR(SUBSCRIPT_RANGE);
+        rt.chan[ch].pos = n - 1;
+    }
+    EXPECT(',', COMMA);
+    return (off_t)rt.chan[ch].pos ++ * rt.chan[ch].reclen;
+}
+
+/** Parse the width of a string field in a record, "TO width", if any, else
+    return the default width: the field is checked to fit the record. */
+int chan_field(int ch, int at) {
+    int width = STR_FIELD;
+    if (CODE == CODE_TO) {
         ++ IP;
-}}
+        width = expr_num();
+        if (width < 1) ERROR(ILLEGAL_INPUT);
+    }
+    if (at + width > rt.chan[ch].reclen) ERROR(RECORD);
+    return width;
+}
 
-void INSTR_DUMP(void) {
-    fputs("KEYWORDS:\n   ", stdout);
-    for (int i = 0; i < sizeof(Keywords)/sizeof(*Keywords); ++ i)
-        printf(" %s", Keywords[i]);
-    fputs("\nOPERATORS:\n   ", stdout);
-    for (int i = 0; i < sizeof(Operators)/sizeof(*Operators); ++ i)
-        printf(" %s", Operators[i].name);
-    putchar('\n');
-    dump_memory();
-    dump_cstr();
-    dump_variables();
-    dump_channels();
+/** If the file opened on channel ch is a regular file, then map it into
+    memory: if this is not possible, the file will be read via stdio. */
+void chan_map(int ch) {
+    struct stat st;
+    int fd = fileno(rt.chan[ch].file);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    rt.chan[ch].map = map;
+    rt.chan[ch].pos = 0;
+    rt.chan[ch].size = st.st_size;
 }
 
-void INSTR_END(void) { IP = NIL; }
-void INSTR_ERROR(void) { longjmp(rt.err_buffer, rt.error = expr_num()); }
+/** Close channel ch, which is assumed to be busy: return 0 if some data
+    could not be written on the file. */
+int chan_close(int ch) {
+    if (rt.chan[ch].map != NULL) {
+        munmap(rt.chan[ch].map, rt.chan[ch].size);
+        rt.chan[ch].map = NULL;
+    }
+    if (rt.chan[ch].ra != NULL) {
+        // The reader may be waiting for a free block or for data to read.
+        rbuf_t *r = rt.chan[ch].ra;
+        pthread_mutex_lock(&r->lock);
+        r->quit = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        eventfd_write(r->wake, 1);
+        pthread_join(r->thread, NULL);
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        close(r->wake);
+        free(r->buf[0]);
+        free(r);
+        rt.chan[ch].ra = NULL;
+    }
+    rt.chan[ch].wb = NULL;    // fclose frees it.
+    rt.chan[ch].reclen = 0;
+    free(rt.chan[ch].buf);
+    rt.chan[ch].buf = NULL;
+    free(rt.chan[ch].name);
+    rt.chan[ch].name = NULL;
+    int ok = fclose(rt.chan[ch].file) == 0;
+    rt.chan[ch].file = NULL;
+    if (rt.chan[ch].pid > 0) {
+        // The process sees the end of its input, or a broken pipe.
+        int status = -1;
+        while (waitpid(rt.chan[ch].pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        rt.status = chan_status(status);
+        rt.chan[ch].pid = 0;
+    }
+    return ok;
+}
 
-void INSTR_FOR(void) {
-    // FOR creates its variable if not already defined by another FOR statement.
-    EXPECT(CODE_IDN, NUMVAR);
-    str_t name = PEEK(IP);
-    addr_t v = var_find(name);
-    if (v != NIL) {
-        if (VAR_TYPE(v) != VAR_FOR) ERROR(FORVAR);
-    } else {    // Create the variable if it doesn't exist.
-        v = rt.vp;     // The variable will be inserted here.
-        // Set value = bound = 0, step = 1, ip0 = ip = 0.
-        var_create(name, VAR_FOR, 0, 0, 1, 0, 0);
+/** Return a buffer of at least size bytes for lines which can't be parsed in
+    place: the buffer is shared and its contents are kept when it grows. */
+char *chan_spare(size_t size) {
+    static _Thread_local char *spare = NULL;
+    static _Thread_local size_t capacity = 0;
+    if (size > capacity) {
+        char *q = realloc(spare, size);
+        if (q == NULL) ERROR(ILLEGAL_INPUT);
+        spare = q;
+        capacity = size;
     }
-    IP += sizeof(str_t);    // Skip the variable's name.
-    // Assign the initial value
-    addr_t va = VAR_ADDR(v);
-    EXPECT(CODE_EQ, ASSIGNMENT);
-    expr();
-    POKE_NUM(va, pop_num());
-    // Parse the TO bound
-    EXPECT(CODE_TO, TO_EXPECTED);
-    POKE_NUM(va + sizeof(num_t), expr_num());
-    // Possibly, parse the STEP
-    if (CODE == CODE_STEP) {
-        ++ IP;
-        POKE_NUM(va + 2*sizeof(num_t), expr_num());
+    return spare;
+}
+
+/** Read the next line from channel ch: *p is set to its first character and
+    *end to the character following the last one, which is '\n' or '\0', the
+    line terminator being dropped. Return 0 if the file is ended. */
+int chan_line(int ch, const char **p, const char **end) {
+    if (rt.chan[ch].map != NULL) {
+        char *p0 = rt.chan[ch].map + rt.chan[ch].pos;
+        size_t n = rt.chan[ch].size - rt.chan[ch].pos;
+        if (n == 0) return 0;
+        char *p1 = memchr(p0, '\n', n);
+        if (p1 != NULL) {
+            rt.chan[ch].pos += p1 - p0 + 1;
+        } else {
+            /*  The last line has no '\n': it's followed by zeroes up to the
+                end of the page, unless it ends exactly with a page, in which
+                case it is copied to be terminated. */
+            p1 = p0 + n;
+            rt.chan[ch].pos = rt.chan[ch].size;
+            if (rt.chan[ch].size % sysconf(_SC_PAGESIZE) == 0) {
+                p0 = memcpy(chan_spare(n + 1), p0, n);
+                p1 = p0 + n;
+                *p1 = '\0';
+        }}
+        *p = p0;
+        *end = p1;
+    } else if (rt.chan[ch].ra != NULL) {
+        /*  A line inside a block is parsed in place, while a line across
+            two or more blocks is collected in the spare buffer. */
+        rbuf_t *r = rt.chan[ch].ra;
+        size_t n = 0;
+        if (!ra_ready(r)) return 0;
+        for (;;) {
+            int i = r->head % RA_BLOCKS;
+            char *p0 = r->buf[i] + r->pos;
+            char *p1 = memchr(p0, '\n', r->len[i] - r->pos);
+            size_t k = (p1 != NULL ? p1 : r->buf[i] + r->len[i]) - p0;
+            r->pos += k + (p1 != NULL);
+            if (p1 != NULL && n == 0) {
+                *p = p0;
+                *end = p1;
+                break;
+            }
+            memcpy(chan_spare(n + k + 1) + n, p0, k);
+            n += k;
+            if (p1 != NULL || !ra_ready(r)) {
+                *p = chan_spare(n + 1);
+                *end = *p + n;
+                *(char*)*end = '\0';
+                break;
+        }}
     } else {
-        POKE_NUM(va + 2*sizeof(num_t), 1);
+        // The terminal uses the buffer in RAM, other files their own.
+        char *b = ch == 0 ? (char*)RAM + rt.buf : rt.chan[ch].buf;
+        if (b == NULL && (b = rt.chan[ch].buf = malloc(BUF_SIZE)) == NULL)
+            ERROR(ILLEGAL_INPUT);
+        if (!fgets(b, BUF_SIZE, rt.chan[ch].file)) return 0;
+        *p = b;
+        *end = b + strcspn(b, "\n");   // Drop the ending '\n' if any.
     }
-    /* A VAR_FOR variable contains also the reference of the line and
-        the instruction where NEXT should jump. */
-    POKE(va + 3*sizeof(num_t), rt.ip0);
-    POKE(va + 3*sizeof(num_t) + sizeof(addr_t), rt.ip);
-    if (!var_for_check(v)) {
-        /*  If the FOR condition is initially false so we skip the loop: looks
-            for the matching "NEXT var" instruction and skip after it. If the
-            FOR-NEXTs don't respect nestings, cross your fingers... */
-        do {
-            if (instr_lookfor(CODE_NEXT) == NIL) ERROR(FOR_WITHOUT_NEXT);
-            EXPECT(CODE_IDN, NUMVAR);
-        } while (PEEK(VAR_NAME(v)) != PEEK(IP));
-        IP += sizeof(str_t);    // Skip the variable's name after NEXT.
-}}
+    rt.chan[ch].bytes += *end - *p + 1;
+    ++ rt.chan[ch].lines;
+    return 1;
+}
 
-void INSTR_GOSUB(void) { instr_gosub(expr_num()); }
-void INSTR_GOTO(void) { instr_goto(expr_num()); }
+/// \}
+/** \defgroup MAT Array Statements
 
-void INSTR_IF(void) {
-    // IF expr: ...
-    // IF expr THEN line
-    // IF expr THEN ...
-    if (expr_num() == 0) instr_skip_line();
-    else if (CODE == CODE_THEN) {
-        if (RAM[IP + 1] == CODE_INTLIT) {
+    MAT INPUT and MAT PRINT move whole rows of a delimited text file from and
+    to a list of arrays: the i-th line of the file contains the i-th items
+    of the vectors, or the i-th row of the matrices, separated by commas, as
+    INPUT would read them.
+
+    Numbers are stored at once, while strings are collected aside and the
+    strings of each array are replaced by a single memmove at the end.
+
+    The other MAT statements operate on whole numerical arrays, a vector
+    being a matrix with a single column, by the mat_lincomb and mat_mul
+    kernels: they use SSE or AVX instructions, if the compiler targets them,
+    else plain C loops, and the product is computed by blocks which fit into
+    the cache. */
+/// \{
+
+/// An array in the list of a MAT INPUT or PRINT statement.
+typedef struct {
+    str_t name;     ///< Name of the array.
+    int type;       ///< VAR_NUM or VAR_STR.
+    int width;      ///< Items per line: 1 or the columns of a matrix.
+} mat_col_t;
+
+/** Parse a list of array names, each one possibly followed by a number of
+    rows between parentheses, storing them in cols: the number of arrays is
+    returned and the least number of rows is stored into *rows. */
+int mat_columns(mat_col_t *cols, int *rows) {
+    int n = 0;
+    *rows = RAM_SIZE;
+    for (;;) {
+        if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
+        if (n == MAT_COLS) ERROR(SYNTAX);
+        addr_t v = var_find(PEEK(IP + 1));
+        if (v == NIL) ERROR(UNDEFINED_VARIABLE);
+        if (!(VAR_TYPE(v) & (VAR_VEC|VAR_MAT))) ERROR(ARRAY);
+        cols[n].name = PEEK(IP + 1);
+        cols[n].type = VAR_TYPE(v) & (VAR_NUM|VAR_STR);
+        cols[n].width = VAR_TYPE(v) & VAR_MAT ? PEEK(VAR_ADDR(v) + sizeof(addr_t)) : 1;
+        IP += 1 + sizeof(addr_t);
+        int d = PEEK(VAR_ADDR(v));
+        if (CODE == '(') {
             ++ IP;
-            instr_goto(expr_num());
-}}}
+            int r = expr_num();
+            if (r < 0 || r > d) ERROR(SUBSCRIPT_RANGE);
+            d = r;
+            EXPECT(')', OPENPAR_WITHOUT_CLOSEPAR);
+        }
+        if (d < *rows) *rows = d;
+        ++ n;
+        if (CODE != ',') return n;
+        ++ IP;
+}}
+
+/** Parse a number at p, which should be followed by a character which is
+    not part of the number, and store into *q the address of the latter (p
+    if no number is found). A decimal with at most 15 digits and without
+    exponent is computed exactly by a single division, else strtod is used. */
+num_t mat_scan_num(const char *p, const char **q) {
+    static const double Pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+        1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+    const char *p0 = p;
+    int negative = *p == '-', digits = 0, decimals = 0;
+    if (*p == '-' || *p == '+') ++ p;
+    uint64_t m = 0;
+    for (; isdigit(*p); ++ p, ++ digits) m = m * 10 + *p - '0';
+    if (*p == '.')
+        for (++ p; isdigit(*p); ++ p, ++ digits, ++ decimals)
+            m = m * 10 + *p - '0';
+    if (digits == 0 || digits > 15 || strchr("eExX", *p) != NULL) {
+        char *p1;
+        num_t n = strtod(p0, &p1);
+        *q = p1;
+        return n;
+    }
+    *q = p;
+    double n = m / Pow10[decimals];
+    return negative ? -n : n;
+}
+
+/** Replace the first n strings of the array named name with the len bytes
+    at p, which are n consecutive C-strings. */
+void mat_splice(str_t name, int n, const char *p, size_t len) {
+    addr_t v = var_find(name);      // It may have been moved.
+    addr_t a = var_items(v), b = a;
+    while (n-- > 0) b += strlen(RAM + b) + 1;
+    var_resize(v, a, b - a, len);
+    memcpy(RAM + a, p, len);
+}
+
+/** Read the lines of channel ch into the arrays listed at IP, until the
+    file or the shortest array ends: the number of lines is stored in rt.num.
+    Blank lines are skipped. */
+void mat_input(int ch) {
+    static _Thread_local struct { char *p; size_t len, size; } text[MAT_COLS];
+    mat_col_t cols[MAT_COLS];
+    int rows, ncols = mat_columns(cols, &rows);
+    addr_t items[MAT_COLS];
+    for (int i = 0; i < ncols; ++ i) {
+        text[i].len = 0;
+        items[i] = var_items(var_find(cols[i].name));
+    }
+    const char *p, *end;
+    int n = 0;
+    while (n < rows && chan_line(ch, &p, &end)) {
+        while (p < end && isspace(*p)) ++ p;
+        if (p == end) continue;
+        for (int i = 0, k = 0; i < ncols; ++ i)
+          for (int j = 0; j < cols[i].width; ++ j, ++ k) {
+            if (k > 0) {
+                if (p == end || *p != ',') ERROR(ILLEGAL_INPUT);
+                ++ p;
+                while (p < end && isspace(*p)) ++ p;
+            }
+            if (cols[i].type == VAR_NUM) {
+                const char *q;
+                num_t x = mat_scan_num(p, &q);
+                if (q == p || q > end) ERROR(ILLEGAL_INPUT);
+                POKE_NUM(items[i] + (n * cols[i].width + j) * sizeof(num_t), x);
+                p = q;
+            } else {
+                // A quoted string may contain commas, and quotes doubled.
+                int quoted = p < end && *p == '"';
+                const char *p1 = end;
+                if (quoted) ++ p;
+                else if ((p1 = memchr(p, ',', end - p)) == NULL) p1 = end;
+                size_t len = p1 - p;    // At most, if quoted.
+                if (text[i].len + len + 1 > text[i].size) {
+                    size_t size = 2 * (text[i].len + len + 1);
+                    char *t = realloc(text[i].p, size);
+                    if (t == NULL) ERROR(OUT_OF_VARIABLES);
+                    text[i].p = t;
+                    text[i].size = size;
+                }
+                char *t = text[i].p + text[i].len;
+                if (quoted) {
+                    for (;;) {
+                        if (p == end) ERROR(EOL_INSIDE_STRING);
+                        if (*p == '"' && (++ p == end || *p != '"')) break;
+                        *t ++ = *p ++;
+                    }
+                } else {
+                    memcpy(t, p, len);
+                    t += len;
+                    p = p1;
+                }
+                *t ++ = '\0';
+                text[i].len = t - text[i].p;
+            }
+            while (p < end && isspace(*p)) ++ p;
+        }
+        ++ n;
+    }
+    for (int i = 0; i < ncols; ++ i)
+        if (cols[i].type == VAR_STR)
+            mat_splice(cols[i].name, n * cols[i].width, text[i].p, text[i].len);
+    rt.num = n;
+}
+
+/// Print the character c on channel ch, whose file is f.
+void mat_putc(int ch, FILE *f, int c) {
+    if (ch == 0) term_putc(c); else fputc(c, f);
+}
+
+/** Print on channel ch the items of the arrays listed at IP, one line per
+    index up to the end of the shortest array: the number of lines is stored
+    in rt.num. Strings containing commas, quotes or blanks at their ends are
+    quoted, with their quotes doubled, so that MAT INPUT reads them back. */
+void mat_print(int ch) {
+    mat_col_t cols[MAT_COLS];
+    int rows, ncols = mat_columns(cols, &rows);
+    addr_t items[MAT_COLS];
+    for (int i = 0; i < ncols; ++ i)
+        items[i] = var_items(var_find(cols[i].name));
+    FILE *f = rt.chan[ch].file;
+    char buf[32];
+    for (int n = 0; n < rows; ++ n) {
+        for (int i = 0, k = 0; i < ncols; ++ i)
+          for (int j = 0; j < cols[i].width; ++ j, ++ k) {
+            const char *s = buf;
+            if (k > 0) mat_putc(ch, f, ',');
+            if (cols[i].type == VAR_NUM) {
+                sprintf(buf, "%g", PEEK_NUM(items[i]));
+                items[i] += sizeof(num_t);
+            } else {
+                s = (char*)RAM + items[i];
+                size_t len = strlen(s);
+                items[i] += len + 1;
+                if (len > 0 && (isspace(*s) || isspace(s[len - 1])
+                                || strpbrk(s, ",\"") != NULL)) {
+                    mat_putc(ch, f, '"');
+                    for (; *s != '\0'; ++ s) {
+                        if (*s == '"') mat_putc(ch, f, '"');
+                        mat_putc(ch, f, *s);
+                    }
+                    mat_putc(ch, f, '"');
+                    s = NULL;
+            }}
+            if (s != NULL) { if (ch == 0) term_puts(s); else fputs(s, f); }
+        }
+        mat_putc(ch, f, '\n');
+    }
+    rt.num = rows;
+    if (ch == 0) { if (!rt.batch) fflush(f); }
+    else if (rt.chan[ch].wb != NULL && rt.chan[ch].wb->error) ERROR(WRITE);
+}
+
+/** Read from DATA statements the items of the arrays listed at IP, row by
+    row. */
+void mat_read(void) {
+    extern addr_t instr_data(void);
+    for (;;) {
+        if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
+        addr_t v = var_find(PEEK(IP + 1));
+        if (v == NIL) ERROR(UNDEFINED_VARIABLE);
+        int type = VAR_TYPE(v);
+        if (!(type & (VAR_VEC|VAR_MAT))) ERROR(ARRAY);
+        IP += 1 + sizeof(addr_t);
+        int n = PEEK(VAR_ADDR(v));
+        if (type & VAR_MAT) n *= PEEK(VAR_ADDR(v) + sizeof(addr_t));
+        type &= VAR_NUM|VAR_STR;
+        // Strings are stored one after the other, as they are read.
+        for (addr_t va = var_items(v); n-- > 0; ) {
+            addr_t b = instr_data();
+            const char *p = RAM + b;
+            p = assign_value(type, v, va, p, p + strlen(p));
+            if (p == NULL) ERROR(DATA);
+            rt.data_next = (byte_t*)p - RAM;
+            va += type == VAR_NUM ? sizeof(num_t) : strlen(RAM + va) + 1;
+        }
+        if (CODE != ',') break;
+        ++ IP;
+}}
+
+/// A numerical array operand of MAT: a vector is a matrix with one column.
+typedef struct {
+    num_t *p;       ///< First item, in the RAM.
+    int rows, cols;
+} mat_t;
+
+/// Parse the name of a numerical array and return it.
+mat_t mat_array(void) {
+    if (CODE != CODE_IDN) ERROR(NUMVAR);
+    addr_t v = var_find(PEEK(IP + 1));
+    if (v == NIL) ERROR(UNDEFINED_VARIABLE);
+    if (!(VAR_TYPE(v) & (VAR_VEC|VAR_MAT))) ERROR(ARRAY);
+    IP += 1 + sizeof(addr_t);
+    mat_t m = { (num_t*)(RAM + var_items(v)), PEEK(VAR_ADDR(v)), 1 };
+    if (VAR_TYPE(v) & VAR_MAT) m.cols = PEEK(VAR_ADDR(v) + sizeof(addr_t));
+    return m;
+}
+
+/// Return 1 if IP points to the identifier name, used as a MAT function.
+int mat_function(const char *name) {
+    return CODE == CODE_IDN && strcmp(RAM + PEEK(IP + 1), name) == 0;
+}
+
+/// Raise an error if the arrays a and b have not the same dimensions.
+void mat_conform(mat_t a, mat_t b) {
+    if (a.rows != b.rows || a.cols != b.cols) ERROR(DIMENSION);
+}
+
+/** Return a buffer of at least n numbers, for results which can't be stored
+    at once into their arrays: the buffer is shared. */
+num_t *mat_spare(size_t n) {
+    static _Thread_local num_t *spare = NULL;
+    static _Thread_local size_t capacity = 0;
+    if (n > capacity) {
+        num_t *q = realloc(spare, n * sizeof(num_t));
+        if (q == NULL) ERROR(OUT_OF_VARIABLES);
+        spare = q;
+        capacity = n;
+    }
+    return spare;
+}
+
+/*  Kernels process SIMD_N numbers at a time by the following operations, if
+    the compiler targets AVX or SSE, and the remaining ones by plain loops. */
+_Static_assert(sizeof(num_t) == sizeof(float), "SIMD KERNELS NEED FLOATS");
+#if defined(__AVX__)
+#   define SIMD_N 8
+typedef __m256 simd_t;
+#   define simd_set _mm256_set1_ps
+#   define simd_load _mm256_loadu_ps
+#   define simd_store _mm256_storeu_ps
+#   define simd_add _mm256_add_ps
+#   define simd_sub _mm256_sub_ps
+#   define simd_mul _mm256_mul_ps
+#   define simd_div _mm256_div_ps
+#   define simd_max _mm256_max_ps
+#   define simd_min _mm256_min_ps
+#elif defined(__SSE__)
+#   define SIMD_N 4
+typedef __m128 simd_t;
+#   define simd_set _mm_set1_ps
+#   define simd_load _mm_loadu_ps
+#   define simd_store _mm_storeu_ps
+#   define simd_add _mm_add_ps
+#   define simd_sub _mm_sub_ps
+#   define simd_mul _mm_mul_ps
+#   define simd_div _mm_div_ps
+#   define simd_max _mm_max_ps
+#   define simd_min _mm_min_ps
+#endif
+
+/** Set y[i] = a * x[i] + b * z[i] for i = 0 to n - 1: y may coincide with x
+    or z. This is the kernel of all MAT operations. */
+void mat_lincomb(num_t *y, num_t a, const num_t *x, num_t b, const num_t *z,
+                 size_t n) {
+    size_t i = 0;
+#ifdef SIMD_N
+    simd_t va = simd_set(a), vb = simd_set(b);
+    for (; i + SIMD_N <= n; i += SIMD_N)
+        simd_store(y + i, simd_add(simd_mul(va, simd_load(x + i)),
+                                   simd_mul(vb, simd_load(z + i))));
+#endif
+    for (; i < n; ++ i) y[i] = a * x[i] + b * z[i];
+}
+
+/** Set y[i] = u op v for i = 0 to n - 1, where op is the code of one of the
+    operators + - * / ^, u = x[i], or a if x is NULL, and v = z[i], or b if z
+    is NULL: y may coincide with x or z. Errors are raised before y changes,
+    but for ^, since pow is computed item by item. */
+void vec_op(num_t *y, const num_t *x, num_t a, int op, const num_t *z,
+            num_t b, size_t n) {
+    size_t i = 0;
+    if (op == CODE_DIV) {
+        if (z == NULL && b == 0) ERROR(ZERO);
+        for (size_t j = 0; z != NULL && j < n; ++ j)
+            if (z[j] == 0) ERROR(ZERO);
+    } else if (op == CODE_POW) {
+        for (; i < n; ++ i) {
+            num_t u = x ? x[i] : a, v = z ? z[i] : b;
+            if (u == 0 && v <= 0) ERROR(DOMAIN);
+            errno = 0;
+            y[i] = pow(u, v);
+            if (errno) ERROR(DOMAIN);
+        }
+        return;
+    }
+#ifdef SIMD_N
+    simd_t va = simd_set(a), vb = simd_set(b);
+    for (; i + SIMD_N <= n; i += SIMD_N) {
+        simd_t u = x ? simd_load(x + i) : va, v = z ? simd_load(z + i) : vb;
+        switch (op) {
+        case CODE_PLUS: u = simd_add(u, v); break;
+        case CODE_MINUS: u = simd_sub(u, v); break;
+        case CODE_MUL: u = simd_mul(u, v); break;
+        default: u = simd_div(u, v);
+        }
+        simd_store(y + i, u);
+    }
+#endif
+    for (; i < n; ++ i) {
+        num_t u = x ? x[i] : a, v = z ? z[i] : b;
+        switch (op) {
+        case CODE_PLUS: y[i] = u + v; break;
+        case CODE_MINUS: y[i] = u - v; break;
+        case CODE_MUL: y[i] = u * v; break;
+        default: y[i] = u / v;
+    }}
+}
+
+/// Return the sum of x[i] * z[i], or of x[i] if z is NULL, for i < n.
+num_t vec_sum(const num_t *x, const num_t *z, size_t n) {
+    size_t i = 0;
+    double s = 0;
+#ifdef SIMD_N
+    simd_t vs = simd_set(0);
+    for (; i + SIMD_N <= n; i += SIMD_N)
+        vs = simd_add(vs, z ? simd_mul(simd_load(x + i), simd_load(z + i))
+                            : simd_load(x + i));
+    num_t lanes[SIMD_N];
+    simd_store(lanes, vs);
+    for (int j = 0; j < SIMD_N; ++ j) s += lanes[j];
+#endif
+    for (; i < n; ++ i) s += z ? x[i] * z[i] : x[i];
+    return s;
+}
+
+/// Return the maximum of x[0:n], if max != 0, else the minimum.
+num_t vec_extreme(const num_t *x, int max, size_t n) {
+    num_t r = x[0];
+    size_t i = 0;
+#ifdef SIMD_N
+    if (n >= SIMD_N) {
+        simd_t vr = simd_load(x);
+        for (i = SIMD_N; i + SIMD_N <= n; i += SIMD_N)
+            vr = max ? simd_max(vr, simd_load(x + i))
+                     : simd_min(vr, simd_load(x + i));
+        num_t lanes[SIMD_N];
+        simd_store(lanes, vr);
+        for (int j = 0; j < SIMD_N; ++ j)
+            if (max ? lanes[j] > r : lanes[j] < r) r = lanes[j];
+    }
+#endif
+    for (; i < n; ++ i) if (max ? x[i] > r : x[i] < r) r = x[i];
+    return r;
+}
+
+/** Set c = a * b, where c may coincide with a or b: the product is computed
+    into a spare buffer, a block of MAT_BLOCK rows of b times a block of
+    MAT_BLOCK columns at a time, so that the block stays in the cache while
+    it is combined with the rows of a. */
+void mat_mul(mat_t c, mat_t a, mat_t b) {
+    if (a.cols != b.rows || c.rows != a.rows || c.cols != b.cols)
+        ERROR(DIMENSION);
+    int m = a.rows, n = a.cols, p = b.cols;
+    num_t *t = memset(mat_spare(m * p), 0, m * p * sizeof(num_t));
+    for (int k0 = 0; k0 < n; k0 += MAT_BLOCK) {
+        int k1 = k0 + MAT_BLOCK < n ? k0 + MAT_BLOCK : n;
+        for (int j0 = 0; j0 < p; j0 += MAT_BLOCK) {
+            int w = j0 + MAT_BLOCK < p ? MAT_BLOCK : p - j0;
+            for (int i = 0; i < m; ++ i) {
+                num_t *ti = t + i * p + j0;
+                for (int k = k0; k < k1; ++ k)
+                    mat_lincomb(ti, 1, ti, a.p[i * n + k], b.p + k * p + j0, w);
+    }}}
+    memcpy(c.p, t, m * p * sizeof(num_t));
+}
+
+/// Set c to the transpose of a, where c may coincide with a.
+void mat_trn(mat_t c, mat_t a) {
+    if (c.rows != a.cols || c.cols != a.rows) ERROR(DIMENSION);
+    int m = a.rows, n = a.cols;
+    num_t *t = mat_spare(m * n);
+    for (int i0 = 0; i0 < m; i0 += MAT_BLOCK)
+        for (int j0 = 0; j0 < n; j0 += MAT_BLOCK)
+            for (int i = i0; i < m && i < i0 + MAT_BLOCK; ++ i)
+                for (int j = j0; j < n && j < j0 + MAT_BLOCK; ++ j)
+                    t[j * m + i] = a.p[i * n + j];
+    memcpy(c.p, t, m * n * sizeof(num_t));
+}
+
+/** Set c to the inverse of a, where c may coincide with a, by Gauss-Jordan
+    elimination with partial pivoting, computed in double precision: raise
+    an error if a is singular. */
+void mat_inv(mat_t c, mat_t a) {
+    if (a.rows != a.cols) ERROR(DIMENSION);
+    mat_conform(c, a);
+    int n = a.rows;
+    // The n x 2n matrix [a | 1] is reduced to [1 | inverse of a].
+    double *t = (double*)mat_spare(4 * n * n), max = 0;
+    for (int i = 0; i < n; ++ i)
+        for (int j = 0; j < n; ++ j) {
+            t[i * 2*n + j] = a.p[i * n + j];
+            t[i * 2*n + n + j] = i == j;
+            if (fabs(a.p[i * n + j]) > max) max = fabs(a.p[i * n + j]);
+        }
+    for (int k = 0; k < n; ++ k) {
+        int r = k;
+        for (int i = k + 1; i < n; ++ i)
+            if (fabs(t[i * 2*n + k]) > fabs(t[r * 2*n + k])) r = i;
+        if (fabs(t[r * 2*n + k]) <= max * n * 1e-12) ERROR(DOMAIN);
+        if (r != k)
+            for (int j = 0; j < 2*n; ++ j) {
+                double x = t[k * 2*n + j];
+                t[k * 2*n + j] = t[r * 2*n + j];
+                t[r * 2*n + j] = x;
+            }
+        double *tk = t + k * 2*n, pivot = tk[k];
+        for (int j = 0; j < 2*n; ++ j) tk[j] /= pivot;
+        for (int i = 0; i < n; ++ i) {
+            double *ti = t + i * 2*n, f = ti[k];
+            if (i != k && f != 0)
+                for (int j = 0; j < 2*n; ++ j) ti[j] -= f * tk[j];
+    }}
+    for (int i = 0; i < n; ++ i)
+        for (int j = 0; j < n; ++ j)
+            c.p[i * n + j] = t[i * 2*n + n + j];
+}
+
+/** Parse and execute an assignment to a whole numerical array c, whose name
+    is at IP:
+
+        MAT c = ZER | CON | IDN
+        MAT c = a | a + b | a - b | a * b | (k) * a | TRN(a) | INV(a)
+*/
+void mat_assign(void) {
+    mat_t c = mat_array();
+    size_t n = c.rows * c.cols;
+    EXPECT(CODE_EQ, ASSIGNMENT);
+    if (mat_function("ZER") || mat_function("CON") || mat_function("IDN")) {
+        char f = RAM[PEEK(IP + 1)];
+        IP += 1 + sizeof(addr_t);
+        if (f == 'I' && c.rows != c.cols) ERROR(DIMENSION);
+        for (size_t i = 0; i < n; ++ i) c.p[i] = f == 'C';
+        if (f == 'I')
+            for (int i = 0; i < c.rows; ++ i) c.p[i * c.cols + i] = 1;
+    } else if (mat_function("TRN") || mat_function("INV")) {
+        char f = RAM[PEEK(IP + 1)];
+        IP += 1 + sizeof(addr_t);
+        EXPECT('(', OPENEDPAR);
+        mat_t a = mat_array();
+        EXPECT(')', CLOSEDPAR);
+        if (f == 'T') mat_trn(c, a); else mat_inv(c, a);
+    } else if (CODE == '(') {
+        ++ IP;
+        num_t k = expr_num();
+        EXPECT(')', CLOSEDPAR);
+        EXPECT(CODE_MUL, SYNTAX);
+        mat_t a = mat_array();
+        mat_conform(c, a);
+        mat_lincomb(c.p, k, a.p, 0, a.p, n);
+    } else {
+        mat_t a = mat_array();
+        if (CODE == CODE_PLUS || CODE == CODE_MINUS) {
+            num_t sign = CODE == CODE_PLUS ? 1 : -1;
+            ++ IP;
+            mat_t b = mat_array();
+            mat_conform(c, a);
+            mat_conform(c, b);
+            mat_lincomb(c.p, 1, a.p, sign, b.p, n);
+        } else if (CODE == CODE_MUL) {
+            ++ IP;
+            mat_mul(c, a, mat_array());
+        } else {
+            mat_conform(c, a);
+            memmove(c.p, a.p, n * sizeof(num_t));
+}}}
+
+/** Parse the parameters (a) or, for DOT, (a, b) of the reduction with the
+    given operator code and push its result. */
+void mat_reduce(int code) {
+    EXPECT('(', OPENEDPAR);
+    mat_t a = mat_array();
+    size_t n = a.rows * a.cols;
+    num_t r;
+    if (code == CODE_DOT) {
+        EXPECT(',', COMMA);
+        mat_t b = mat_array();
+        mat_conform(a, b);
+        r = vec_sum(a.p, b.p, n);
+    } else if (code == CODE_MAX || code == CODE_MIN) {
+        r = vec_extreme(a.p, code == CODE_MAX, n);
+    } else {
+        r = vec_sum(a.p, NULL, n);
+        if (code == CODE_MEAN) r /= n;
+    }
+    EXPECT(')', CLOSEDPAR);
+    push_num(r);
+}
+
+/** Whole-array expressions, as a() = b() * k + c(), are evaluated while they
+    are parsed, as the scalar ones are, but on operands which can be either
+    numbers, arrays in the RAM or temporary arrays: the latter are allocated
+    as a stack in rt.vec and released as soon as they are consumed. */
+typedef struct {
+    num_t *p;       ///< Items of an array in the RAM, else NULL.
+    size_t temp;    ///< 1 + offset in rt.vec of a temporary array, else 0.
+    num_t k;        ///< The number, if the operand is not an array.
+} vec_t;
+
+/// Return 1 if IP points to a whole numerical array a().
+int vec_whole(void) {
+    return CODE == CODE_IDN && RAM[IP + 1 + sizeof(addr_t)] == '('
+        && RAM[IP + 2 + sizeof(addr_t)] == ')';
+}
+
+/// Return the items of the operand a, or NULL if it is a number.
+num_t *vec_items(vec_t a) { return a.temp ? rt.vec + a.temp - 1 : a.p; }
+
+/// Allocate a temporary array of n items and return it.
+vec_t vec_temp(size_t n) {
+    if (rt.vec_used + n > rt.vec_size) {
+        size_t size = rt.vec_used + n > 2 * rt.vec_size
+                    ? rt.vec_used + n : 2 * rt.vec_size;
+        num_t *q = realloc(rt.vec, size * sizeof(num_t));
+        if (q == NULL) ERROR(OUT_OF_VARIABLES);
+        rt.vec = q;
+        rt.vec_size = size;
+    }
+    vec_t t = { NULL, rt.vec_used + 1, 0 };
+    rt.vec_used += n;
+    return t;
+}
+
+/// Return a op b, where op is the code of + - * / or ^ and arrays are like c.
+vec_t vec_binary(vec_t a, int op, vec_t b, mat_t c) {
+    if (vec_items(a) == NULL && vec_items(b) == NULL) {
+        push_num(a.k);
+        push_num(b.k);
+        (*Operators[op - CODE_STARTOPERATOR - 1].routine)();
+        a.k = pop_num();
+        return a;
+    }
+    // The result overwrites a temporary operand: since b was parsed after a,
+    // if both are temporary then b is on top of the stack and is dropped.
+    vec_t y = a.temp ? a : b.temp ? b : vec_temp(c.rows * c.cols);
+    if (a.temp && b.temp) rt.vec_used = b.temp - 1;
+    vec_op(vec_items(y), vec_items(a), a.k, op, vec_items(b), b.k,
+           c.rows * c.cols);
+    return y;
+}
+
+vec_t vec_expr(mat_t c);
+
+/** Parse a primary of a whole-array expression, whose arrays are like c:
+    (e), a() or a scalar operand, possibly after prefix operators. */
+vec_t vec_primary(mat_t c) {
+    vec_t a = { NULL, 0, 0 };
+    if (CODE == '(') {
+        ++ IP;
+        a = vec_expr(c);
+        EXPECT(')', CLOSEDPAR);
+    } else if (vec_whole()) {
+        mat_t m = mat_array();
+        mat_conform(c, m);
+        IP += 2;    // Skip "()".
+        a.p = m.p;
+    } else {
+        // Evaluate as in expr, but up to the operand.
+        rt_epush(NULL, 0);
+        if (expr_prefix_operators()) expr_operand();
+        rt_epop(1);
+        -- rt.estack_next;
+        a.k = pop_num();
+    }
+    return a;
+}
+
+/// Parse a factor of a whole-array expression: p ^ p ^ ... or - f.
+vec_t vec_factor(mat_t c) {
+    if (CODE == CODE_MINUS) {
+        ++ IP;
+        vec_t zero = { NULL, 0, 0 };
+        return vec_binary(zero, CODE_MINUS, vec_factor(c), c);
+    }
+    vec_t a = vec_primary(c);
+    while (CODE == CODE_POW) {
+        ++ IP;
+        a = vec_binary(a, CODE_POW, vec_primary(c), c);
+    }
+    return a;
+}
+
+/// Parse a term of a whole-array expression: f * f / f ...
+vec_t vec_term(mat_t c) {
+    vec_t a = vec_factor(c);
+    while (CODE == CODE_MUL || CODE == CODE_DIV) {
+        int op = CODE;
+        ++ IP;
+        a = vec_binary(a, op, vec_factor(c), c);
+    }
+    return a;
+}
+
+/// Parse a whole-array expression, whose arrays are like c: t + t - t ...
+vec_t vec_expr(mat_t c) {
+    vec_t a = vec_term(c);
+    while (CODE == CODE_PLUS || CODE == CODE_MINUS) {
+        int op = CODE;
+        ++ IP;
+        a = vec_binary(a, op, vec_term(c), c);
+    }
+    return a;
+}
+
+/** Parse and execute an assignment to a whole numerical array c, whose name
+    is at IP:
+
+        c() = e
+
+    where e is an expression on numbers and whole arrays a() with the same
+    dimensions as c, operated item by item by + - * / and ^. */
+void vec_let(void) {
+    mat_t c = mat_array();
+    size_t n = c.rows * c.cols;
+    IP += 2;    // Skip "()".
+    EXPECT(CODE_EQ, ASSIGNMENT);
+    size_t used = rt.vec_used;
+    vec_t a = vec_expr(c);
+    num_t *x = vec_items(a);
+    if (x == NULL)
+        for (size_t i = 0; i < n; ++ i) c.p[i] = a.k;
+    else
+        memmove(c.p, x, n * sizeof(num_t));
+    rt.vec_used = used;
+}
+
+/// \}
+/** \defgroup SORT Array Sorting
+
+    SORT reorders the rows of an array, that are its items if it is a vector,
+    by introsort on a table of keys, with their row indexes as a tie-break,
+    so that the sort is stable: then the rows are copied at once, through a
+    buffer, in their new order. String rows are never moved while sorted,
+    thus the sort takes O(n log n) comparisons and O(size) copies. */
+/// \{
+
+/// A row to sort: its key is s if it is not NULL, else k.
+typedef struct {
+    num_t k;
+    const char *s;
+    int index;      ///< Row index in the array, from 0.
+} sort_item_t;
+
+/// Return 1 if a should precede b, in descending order if desc != 0.
+int sort_less(const sort_item_t *a, const sort_item_t *b, int desc) {
+    int c = a->s ? strcmp(a->s, b->s) : (a->k > b->k) - (a->k < b->k);
+    if (desc) c = -c;
+    return c < 0 || (c == 0 && a->index < b->index);
+}
+
+/// Swap the items a and b.
+void sort_swap(sort_item_t *a, sort_item_t *b) {
+    sort_item_t t = *a; *a = *b; *b = t;
+}
+
+/// Move down the item at j of the heap a[0:n].
+void sort_sift(sort_item_t *a, int j, int n, int desc) {
+    for (int c; (c = 2*j + 1) < n; j = c) {
+        if (c + 1 < n && sort_less(a + c, a + c + 1, desc)) ++ c;
+        if (!sort_less(a + j, a + c, desc)) break;
+        sort_swap(a + j, a + c);
+}}
+
+/// Sort the n items at a by heapsort.
+void sort_heap(sort_item_t *a, int n, int desc) {
+    for (int i = n / 2 - 1; i >= 0; -- i) sort_sift(a, i, n, desc);
+    for (int end = n - 1; end > 0; -- end) {
+        sort_swap(a, a + end);
+        sort_sift(a, 0, end, desc);
+}}
+
+/** Sort the n items at a by introsort: quicksort on the median of three,
+    switching to heapsort after depth partitions and to insertion sort on
+    short ranges. */
+void sort_intro(sort_item_t *a, int n, int depth, int desc) {
+    while (n > 16) {
+        if (depth-- == 0) { sort_heap(a, n, desc); return; }
+        // Order a[0], a[n/2], a[n-1] and use the median as pivot.
+        sort_item_t *m = a + n / 2, *z = a + n - 1;
+        if (sort_less(m, a, desc)) sort_swap(m, a);
+        if (sort_less(z, m, desc)) {
+            sort_swap(z, m);
+            if (sort_less(m, a, desc)) sort_swap(m, a);
+        }
+        sort_item_t pivot = *m;
+        int i = 0, j = n - 1;
+        for (;;) {
+            while (sort_less(a + i, &pivot, desc)) ++ i;
+            while (sort_less(&pivot, a + j, desc)) -- j;
+            if (i >= j) break;
+            sort_swap(a + i ++, a + j --);
+        }
+        // Recur on the shorter side, iterate on the longer one.
+        if (j + 1 < n - j - 1) {
+            sort_intro(a, j + 1, depth, desc);
+            a += j + 1; n -= j + 1;
+        } else {
+            sort_intro(a + j + 1, n - j - 1, depth, desc);
+            n = j + 1;
+    }}
+    for (int i = 1; i < n; ++ i) {
+        sort_item_t t = a[i];
+        int j = i;
+        for (; j > 0 && sort_less(&t, a + j - 1, desc); -- j) a[j] = a[j - 1];
+        a[j] = t;
+}}
+
+/** Parse the name of an array variable and return its address, storing its
+    dimensions into *rows and *cols, that is 1 for a vector. */
+addr_t sort_array(int *rows, int *cols) {
+    if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
+    addr_t v = var_find(PEEK(IP + 1));
+    if (v == NIL) ERROR(UNDEFINED_VARIABLE);
+    if (!(VAR_TYPE(v) & (VAR_VEC|VAR_MAT))) ERROR(ARRAY);
+    IP += 1 + sizeof(addr_t);
+    *rows = PEEK(VAR_ADDR(v));
+    *cols = VAR_TYPE(v) & VAR_MAT ? PEEK(VAR_ADDR(v) + sizeof(addr_t)) : 1;
+    return v;
+}
+
+/** Sort the rows of the array v, with the given dimensions, by the key in
+    column col: if index is not NIL, the array is left as it is, and the
+    indexes of its rows, in sorted order, are stored into the numerical
+    vector with that name, which is created if needed. */
+void sort_rows(addr_t v, int rows, int cols, int col, int desc, str_t index) {
+    addr_t a = var_items(v), p = a;
+    size_t size = (size_t)rows * cols * sizeof(num_t);
+    int str = VAR_TYPE(v) & VAR_STR;
+    if (str) {
+        for (long n = (long)rows * cols; n > 0; -- n) p += strlen(RAM + p) + 1;
+        size = p - a;
+    }
+    // Keys, offsets of the rows from a and a buffer for the sorted rows.
+    size_t bytes = rows * sizeof(sort_item_t) + (rows + 1) * sizeof(int);
+    sort_item_t *items = (sort_item_t*)mat_spare(
+        (bytes + size + sizeof(num_t) - 1) / sizeof(num_t));
+    int *offs = (int*)(items + rows);
+    char *buf = (char*)items + bytes;
+    p = a;
+    for (int i = 0; i < rows; ++ i) {
+        offs[i] = p - a;
+        items[i].index = i;
+        items[i].s = NULL;
+        if (str) {
+            for (int j = 0; j < cols; ++ j) {
+                if (j == col - 1) items[i].s = (char*)RAM + p;
+                p += strlen(RAM + p) + 1;
+            }
+        } else {
+            items[i].k = PEEK_NUM(p + (col - 1) * sizeof(num_t));
+            p += cols * sizeof(num_t);
+    }}
+    offs[rows] = p - a;
+    int depth = 2;
+    for (int n = rows; n > 1; n >>= 1) depth += 2;
+    sort_intro(items, rows, depth, desc);
+    if (index != NIL) {
+        addr_t w = var_find(index);
+        if (w == NIL) {
+            w = rt.vp;
+            var_create(index, VAR_NUM|VAR_VEC, rows, 1, 0, 0, 0);
+        }
+        if (VAR_TYPE(w) != (VAR_NUM|VAR_VEC)) ERROR(NUMVAR);
+        if (PEEK(VAR_ADDR(w)) != rows) ERROR(DIMENSION);
+        for (int i = 0; i < rows; ++ i)
+            POKE_NUM(var_items(w) + i * sizeof(num_t), items[i].index + 1);
+    } else {
+        for (int i = 0; i < rows; ++ i) {
+            int r = items[i].index, len = offs[r + 1] - offs[r];
+            memcpy(buf, RAM + a + offs[r], len);
+            buf += len;
+        }
+        memcpy(RAM + a, buf - size, size);
+}}
+
+/// \}
+/// \defgroup INSTR Instruction Implementation
+/// \{
+
+/** Parse a possible channel and return its number. FILE file0 is assigned
+    to the 0 channel if #0 is parsed. The channel is checked to be busy, else
+    an error is issued. */
+int instr_channel(FILE *file0) {
+    int ch = 0; // a priori buffer #0
+    rt.chan[ch].file = file0;
+    if (CODE == '#') {
+        ++ IP;
+        ch = chan_opened(expr_num());  // Parse the channel number.
+        EXPECT(',', COMMA);
+    }
+    return ch;
+}
+
+/** Advance IP to the first token of the next instruction: if needed, IP is
+    advanced to the first instruction of the next line, if any. The updated
+    value of IP is returned, unless no further instruction is available, in
+    which case NIL is returned. */
+addr_t instr_skip(void) {
+    /*  If RAM[ip] == 0 then the current line is ended, so ip+1 points to
+        the next one; if RAM[ip] == ':' then ip+1 points to the next
+        instruction. */
+    while (CODE != 0) {
+        if (CODE == ':' || CODE == CODE_THEN) return ++IP;
+        IP = token_skip(IP);
+    }
+    // Here we are at the end of the line.
+    rt.ip0 = IP + 1;
+    return LINE_START;
+}
+
+/// Advance IP to the first token of the next program's line.
+addr_t instr_skip_line(void) {
+    rt.ip0 += RAM[rt.ip0];    // Skip to the next line.
+    return LINE_START;
+}
+
+/** Starting from the pointer IP, looks for the instruction whose CODE is
+    code and returns the updated value of IP to the address of the token
+    following it, or NIL if no such instruction exists. */
+addr_t instr_lookfor(byte_t code) {
+    do if (CODE == code) return ++IP; while (instr_skip() != NIL);
+    return NIL;
+}
+
+// Used by GOTO and ON
+void instr_goto(int line) {
+    rt.ip0 = prog_find(line);
+    LINE_START;
+}
+
+// Used by GOSUB and ON
+void instr_gosub(int line) {
+    rpush(rt.ip0, IP);
+    instr_goto(line);
+}
+
+/** Move rt.data_next to the next item of a DATA statement and return it:
+    raise an error if there are no more items. */
+addr_t instr_data(void) {
+    /*  rt.data_next points to an instruction keyword, and in this case we
+        check against a DATA, else find the next DATA instruction if any, or
+        points to ',' or '\0' inside a DATA line. */
+    if (RAM[rt.data_next] == CODE_DATA || RAM[rt.data_next] == ',') {
+        ++ rt.data_next;   // Skip DATA or ','.
+    } else {
+        // Save current line pointers, instr_lookfor changes them!
+        addr_t ip0_saved = rt.ip0, ip_saved = IP;
+        IP = rt.data_next;
+        rt.data_next = instr_lookfor(CODE_DATA);
+        // Restore line pointers.
+        rt.ip0 = ip0_saved, IP = ip_saved;
+        if (rt.data_next == NIL) ERROR(OUT_OF_DATA);
+    }
+    return rt.data_next;
+}
+
+void INSTR_ATTR(void) {
+    // ATTR property = value, ...
+    // where property can be: BOLD, UNDER, BACK, FORE, BRIGHT, BLINK, REVERSE,
+    // RESET, BUFFER; values can be BOLD, UNDER, BRIGHT, BLINK, BUFFER = 0|1;
+    // BACK, FORE = 0,...,7
+    int sent = 0;       // Whether escapes were written, to be flushed.
+    for (;;) {
+        EXPECT(CODE_IDN, ILLEGAL_ATTRIBUTE);
+        char *property = RAM + PEEK(IP);
+        IP += sizeof(str_t);
+        unsigned value = 1;
+        if (CODE == CODE_EQ) {
+            ++ IP;
+            value = expr_num();
+        }
+        // Attributes are meaningless in batch mode, but still parsed.
+        if (rt.batch) {
+            if (CODE != ',') break;
+            ++ IP;
+            continue;
+        }
+        int a = rt.attr, bit = 0;
+        if (strcmp(property, "BACK") == 0) a = (a & ~ATTR_BACK) | (value&7) << 3;
+        else if (strcmp(property, "FORE") == 0) a = (a & ~ATTR_FORE) | (value&7);
+        else if (strcmp(property, "RESET") == 0) a = ATTR_DEFAULT;
+        else if (strcmp(property, "BUFFER") == 0) term_buffer(value & 1);
+        else if (strcmp(property, "BLINK") == 0) bit = ATTR_BLINK;
+        else if (strcmp(property, "BOLD") == 0) bit = ATTR_BOLD;
+        else if (strcmp(property, "BRIGHT") == 0) bit = ATTR_BRIGHT;
+        else if (strcmp(property, "REVERSE") == 0) bit = ATTR_REVERSE;
+        else if (strcmp(property, "UNDER") == 0) bit = ATTR_UNDER;
+        else {
+            ERROR(ILLEGAL_ATTRIBUTE);
+        }
+        if (bit != 0) a = (value & 1) ? a | bit : a & ~bit;
+        rt.attr = a;
+        // With the screen buffer, attributes are sent to the terminal by REFRESH.
+        if (rt.screen[0] == NULL) {
+            char esc[64];
+            term_attr_escape(esc, a);
+            fputs(esc, rt.out);
+            sent = 1;
+        }
+        if (CODE != ',') break;
+        ++ IP;
+}
+    if (sent) fflush(rt.out);
+}
+
+void INSTR_BYE(void) {
+    // A host program is not left, only the BASIC one.
+    if (rt.hosted) IP = NIL;
+    else if (prog_check()) {
+        fputs("BYE.\n", rt.out);
+        exit(EXIT_SUCCESS);
+}}
+
+void INSTR_CHAIN(void) {
+    // CHAIN filename[,linenumber]
+    str_t name = expr_str();
+    int line = LINE_MIN - 1;
+    if (CODE == ',') {
+        ++ IP;
+        line = expr_num();
+    }
+    rt_reset(RT_RESET_PROG);
+    if (prog_load(RAM + name)) ERROR(FILE);
+    // Get to the first line to execute.
+    if (line >= LINE_MIN) instr_goto(line); else prog_exec();
+}
+
+void INSTR_CHECKPOINT(void) {
+    // CHECKPOINT filename: the program is resumed from the next statement.
+    extern void instr_next(void), ckpt_write(const char*);
+    str_t name = expr_str();
+    if (rt.ip0 >= rt.pp) ERROR(ILLEGAL_OUTSIDE_PROGRAM);
+    // The calls of functions live on the C stack, which is not saved.
+    if (rt.fn_depth > 0 || rt.parallel) ERROR(CHECKPOINT);
+    snprintf(rt.ckpt, sizeof(rt.ckpt), "%s", RAM + name);
+    addr_t ip0 = rt.ip0, ip = IP;
+    instr_next();
+    ckpt_write(rt.ckpt);
+    rt.ip0 = ip0;
+    IP = ip;
+}
+
+void INSTR_CLEAR(void) {
+    // CLEAR [[s][,p]] or CLEAR map[(key)]
+    if (CODE == CODE_IDN || CODE == CODE_IDNS) {
+        addr_t v = var_find(PEEK(IP + 1));
+        if (v == NIL) ERROR(UNDEFINED_VARIABLE);
+        if (!(VAR_TYPE(v) & VAR_MAP)) ERROR(MAP);
+        map_delete(v);
+        return;
+    }
+    // s = space for strings, p = space for program (in byte).
+    // Get current values both for s and p.
+    int s0 = rt.pp0, s = s0;   // s0 - 0 = current space for strings.
+    int p0 = rt.vp0 - rt.pp0, p = p0;
+    // In any case, delete all variables.
+    rt.vp = rt.vp0;
+    if (CODE == CODE_INTLIT) {
+        s = PEEK(IP + 1);
+        IP += 1 + sizeof(addr_t);
+    }
+    if (CODE == ',') {
+        ++ IP;
+        EXPECT(CODE_INTLIT, VALUE);
+        p = PEEK(IP);
+        IP += sizeof(addr_t);
+    }
+    if (s != s0 || p != p0) {
+        rt.pp0 = rt.pp = s;
+        rt.vp0 = rt.vp = VAR_ALIGNED(s + p);
+        IP = NIL;        
+}}
+
+void INSTR_CLOSE(void) {
+    // CLOSE channel
+    int ch = expr_num();
+    if (ch < 1) ERROR(ILLEGAL_CHANNEL);
+    if (!chan_close(chan_opened(ch))) ERROR(WRITE);
+}
+
+void INSTR_CLS(void) { term_cls(); }
+void INSTR_DATA(void) { instr_skip_line(); }
+void INSTR_DEF(void) {
+    // DEF [PURE] name[(params)] = expr or DEF [PURE] name[(params)] ... FNEND
+    extern int fn_pure(void);
+    fn_pure();
+    IP += 1 + sizeof(str_t);    // Skip the name.
+    if (CODE == '(') {
+        while (CODE != ')' && CODE != 0) IP = token_skip(IP);
+        if (CODE != 0) ++ IP;
+    }
+    if (CODE == CODE_EQ) {
+        instr_skip_line();
+    } else {
+        // Skip the body of the function, or complain at the DEF line.
+        addr_t ip0 = rt.ip0;
+        if (instr_lookfor(CODE_FNEND) == NIL) { rt.ip0 = ip0; ERROR(FNEND); }
+}}
+
+void INSTR_DIM(void) {
+    for (;;) {
+        if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
+        str_t name = PEEK(IP + 1);
+        if (var_find(name) != NIL) ERROR(VARIABLE_ALREADY_DEFINED);
+        addr_t d1, d2;
+        int type = var_array_parse(&name, &d1, &d2);
+        var_create(name, type, d1, d2, 0, 0, 0);
+        if (CODE != ',') break;
+        ++ IP;
+}}
+
+void INSTR_DUMP(void) {
+    fputs("KEYWORDS:\n   ", rt.out);
+    for (int i = 0; i < sizeof(Keywords)/sizeof(*Keywords); ++ i)
+        fprintf(rt.out, " %s", Keywords[i]);
+    fputs("\nOPERATORS:\n   ", rt.out);
+    for (int i = 0; i < sizeof(Operators)/sizeof(*Operators); ++ i)
+        fprintf(rt.out, " %s", Operators[i].name);
+    fputc('\n', rt.out);
+    dump_memory();
+    dump_cstr();
+    dump_variables();
+    dump_channels();
+    dump_functions();
+}
+
+void INSTR_END(void) { IP = NIL; }
+void INSTR_ERROR(void) { longjmp(rt.err_buffer, rt.error = expr_num()); }
+
+void INSTR_FNEND(void) {
+    extern int fn_return(void);
+    if (!fn_return()) ERROR(ILLEGAL_INSTRUCTION);
+}
+
+void INSTR_FOR(void) {
+    // FOR creates its variable if not already defined by another FOR statement.
+    extern addr_t fn_for(str_t);
+    extern int par_for(addr_t);
+    EXPECT(CODE_IDN, NUMVAR);
+    str_t name = PEEK(IP);
+    addr_t v = var_find(name);
+    if (v != NIL) {
+        // A local variable of a function may be used as index, too.
+        if (VAR_TYPE(v) != VAR_FOR && (v = fn_for(name)) == NIL) ERROR(FORVAR);
+    } else {    // Create the variable if it doesn't exist.
+        v = rt.vp;     // The variable will be inserted here.
+        // Set value = bound = 0, step = 1, ip0 = ip = 0.
+        var_create(name, VAR_FOR, 0, 0, 1, 0, 0);
+    }
+    IP += sizeof(str_t);    // Skip the variable's name.
+    // Assign the initial value
+    addr_t va = VAR_ADDR(v);
+    EXPECT(CODE_EQ, ASSIGNMENT);
+    expr();
+    POKE_NUM(va, pop_num());
+    // Parse the TO bound
+    EXPECT(CODE_TO, TO_EXPECTED);
+    POKE_NUM(va + sizeof(num_t), expr_num());
+    // Possibly, parse the STEP
+    if (CODE == CODE_STEP) {
+        ++ IP;
+        POKE_NUM(va + 2*sizeof(num_t), expr_num());
+    } else {
+        POKE_NUM(va + 2*sizeof(num_t), 1);
+    }
+    // The worker threads may run the whole loop.
+    if (token_word("PARALLEL") && par_for(v)) return;
+    /* A VAR_FOR variable contains also the reference of the line and
+        the instruction where NEXT should jump. */
+    POKE(va + 3*sizeof(num_t), rt.ip0);
+    POKE(va + 3*sizeof(num_t) + sizeof(addr_t), rt.ip);
+    if (!var_for_check(v)) {
+        /*  If the FOR condition is initially false so we skip the loop: looks
+            for the matching "NEXT var" instruction and skip after it. If the
+            FOR-NEXTs don't respect nestings, cross your fingers... */
+        do {
+            if (instr_lookfor(CODE_NEXT) == NIL) ERROR(FOR_WITHOUT_NEXT);
+            EXPECT(CODE_IDN, NUMVAR);
+        } while (PEEK(VAR_NAME(v)) != PEEK(IP));
+        IP += sizeof(str_t);    // Skip the variable's name after NEXT.
+}}
+
+void INSTR_FLUSH(void) {
+    // FLUSH [#channel]
+    if (CODE != '#') {
+        chan_flush(0);
+        for (int i = 1; i < rt.chan_num; ++ i)
+            if (rt.chan[i].file != NULL) chan_flush(i);
+    } else {
+        ++ IP;
+        int ch = expr_num();
+        chan_flush(ch == 0 ? 0 : chan_opened(ch));
+}}
+
+void INSTR_GET(void) {
+    // GET #channel, [record], variable [TO width], ...
+    if (CODE != '#') ERROR(HASH);
+    int ch = instr_channel(rt.in);
+    off_t offset = chan_record(ch);
+    int reclen = rt.chan[ch].reclen;
+    char *rec = chan_spare(reclen);
+    ssize_t n = pread(fileno(rt.chan[ch].file), rec, reclen, offset);
+    if (n < reclen) ERROR(OUT_OF_DATA);     // Also partial records.
+    rt.chan[ch].bytes += reclen;
+    ++ rt.chan[ch].lines;
+    for (int at = 0;;) {
+        if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
+        addr_t v = var_insert(IP + 1);
+        addr_t va;
+        int type = var_address(v, &va);
+        if (type & (VAR_NUM|VAR_FOR)) {
+            if (at + sizeof(num_t) > reclen) ERROR(RECORD);
+            num_t x;
+            memcpy(&x, rec + at, sizeof(num_t));
+            POKE_NUM(va, x);
+            at += sizeof(num_t);
+        } else {
+            int width = chan_field(ch, at);
+            char *p = memchr(rec + at, '\0', width);
+            assign_chars(v, va, rec + at, p == NULL ? width : p - (rec + at));
+            at += width;
+        }
+        if (CODE != ',') break;
+        ++ IP;
+}}
+
+void INSTR_GOSUB(void) { instr_gosub(expr_num()); }
+void INSTR_GOTO(void) { instr_goto(expr_num()); }
+
+void INSTR_IF(void) {
+    // IF expr: ...
+    // IF expr THEN line
+    // IF expr THEN ...
+    if (expr_num() == 0) instr_skip_line();
+    else if (CODE == CODE_THEN) {
+        if (RAM[IP + 1] == CODE_INTLIT) {
+            ++ IP;
+            instr_goto(expr_num());
+}}}
 
 void INSTR_INPUT(void) {
-    int ch = instr_channel(stdin);
+    int ch = instr_channel(rt.in);
     if (ch == 0) {
         // A constant string may be printed at this point.
         if (CODE == CODE_STRLIT) {
-            fputs(RAM + PEEK(IP + 1), stderr);
+            fputs(RAM + PEEK(IP + 1), rt_msg());
             IP += 1 + sizeof(str_t);
             if (CODE != ',' && CODE != ';') ERROR(SYNTAX);
             ++ IP;
         }
-        putchar('?');
-    }
-    addr_t b = rt.buf[ch];
-    if (!fgets(RAM + b, BUF_SIZE, rt.channels[ch])) ERROR(ILLEGAL_INPUT);
-    // Drop the ending '\n' if any.
-    char *p = strchr(RAM + b, '\n');
-    if (p != NULL) *p = '\0';
-    // Parse a list of variables and assign values read from buffer b to them.
+        term_putc('?');
+        term_refresh();
+        fflush(rt.out);
+        kbd_restore();
+    }
+    const char *p, *end;
+    if (!chan_line(ch, &p, &end)) ERROR(ILLEGAL_INPUT);
+    // The terminal echoed the newline which ends the input.
+    if (ch == 0 && !rt.batch) term_newline();
+    // Parse a list of variables and assign values read from the line to them.
     for (;;) {
-        b = assign_item(b);
-        if (b == NIL) ERROR(ILLEGAL_INPUT);
+        p = assign_scan(p, end);
+        if (p == NULL) ERROR(ILLEGAL_INPUT);
         if (CODE != ',') break;
         ++ IP;
-        if (RAM[b] != ',') ERROR(ILLEGAL_INPUT);
-        ++ b;
+        if (p == end || *p != ',') ERROR(ILLEGAL_INPUT);
+        ++ p;
 }}
 
 void INSTR_LET(void) {
     // LET v=e, ..., v=e
     for (;;) {
+        if (vec_whole()) {  // v() = e on whole arrays.
+            vec_let();
+            if (CODE != ',') break;
+            ++ IP;
+            continue;
+        }
         if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);        
         // In case of a new definition, save the variable limit rt.vp.
+        str_t name = PEEK(IP + 1);
         addr_t vp_saved = rt.vp;
         addr_t v = var_insert(IP + 1);
         rt.vp = vp_saved;   // Hide the new variable, if any!
+        int created = v == vp_saved;
+        rt.hidden = created ? v : NIL;
         addr_t va;
         int type = var_address(v, &va);
         if (type == VAR_NONE) ERROR(UNDEFINED_VARIABLE);
         EXPECT(CODE_EQ, ASSIGNMENT);
         expr();
-        // If v is a new variable, make it available before assigning it.
-        if (rt.vp == v) rt.vp += VAR_SIZE(v);
+        rt.hidden = NIL;
+        // If v is a new variable, make it available before assigning it,
+        // unless a function called by expr did: then it may have moved.
+        if (created) {
+            if (rt.vp == v) rt.vp += VAR_SIZE(v);
+            else va = VAR_ADDR(v = var_find(name));     // A scalar.
+        }
         // Finally, perform the assignment.
         if (type & VAR_STR)
             assign_string(v, va, pop_str());
@@ -1941,10 +4776,10 @@ void INSTR_LET(void) {
 }}
 
 void INSTR_LINPUT(void) {
-    int ch = instr_channel(stdin);
+    int ch = instr_channel(rt.in);
     // A constant string may be printed at this point.
     if (ch == 0 && CODE == CODE_STRLIT) {
-        fputs(RAM + PEEK(IP + 1), stderr);
+        fputs(RAM + PEEK(IP + 1), rt_msg());
         IP += 1 + sizeof(str_t);
         if (CODE != ',' && CODE != ';') ERROR(SYNTAX);
         ++ IP;
@@ -1954,16 +4789,15 @@ void INSTR_LINPUT(void) {
     addr_t va;
     int type = var_address(v, &va);
     if (!(type & VAR_STR)) ERROR(STRVAR);
-    addr_t b = rt.buf[ch];
-    RAM[b] = '\0';  // A priori empty.
-    fgets(RAM + b, BUF_SIZE, rt.channels[ch]);
-    // Drop the ending '\n' if any.
-    char *p = strchr(RAM + b, '\n'); if (p != NULL) *p = '\0';
-    // Assign to variable v the value of the string b.
-    assign_string(v, va, b);
+    if (ch == 0) { term_refresh(); fflush(rt.out); kbd_restore(); }
+    const char *p, *end;
+    if (!chan_line(ch, &p, &end)) p = end = "";     // A priori empty.
+    if (ch == 0 && !rt.batch) term_newline();
+    // Assign to variable v the line just read.
+    assign_chars(v, va, p, end - p);
 }
 
-void INSTR_LIST(void) { prog_print(stderr); }
+void INSTR_LIST(void) { prog_print(rt_msg()); }
 
 void INSTR_LOAD(void) {
     if (prog_check()) {
@@ -1974,6 +4808,45 @@ void INSTR_LOAD(void) {
         expr_str();  // skip the program name.
 }}
 
+void INSTR_LOCAL(void) {
+    // LOCAL v, ..., v where v is a variable or an array such as DIM ones.
+    extern addr_t fn_bind(str_t, int, num_t, num_t);
+    if (rt.fn_depth == 0) ERROR(ILLEGAL_INSTRUCTION);
+    for (;;) {
+        if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
+        str_t name = PEEK(IP + 1);
+        int local = rt.local == NULL ? 0 : rt.local[name];
+        if (local > rt.frame[rt.fn_depth - 1].bind) ERROR(VARIABLE_ALREADY_DEFINED);
+        if (RAM[IP + 1 + sizeof(str_t)] == '(') {
+            addr_t d1, d2;
+            int type = var_array_parse(&name, &d1, &d2);
+            fn_bind(name, type, d1, d2);
+        } else {
+            fn_bind(name, CODE == CODE_IDN ? VAR_NUM : VAR_STR, 0, 0);
+            IP += 1 + sizeof(str_t);
+        }
+        if (CODE != ',') break;
+        ++ IP;
+}}
+
+void INSTR_MAT(void) {
+    // MAT INPUT [#channel,] array [(rows)], ...
+    // MAT PRINT [#channel,] array [(rows)], ...
+    // MAT READ array, ...
+    // MAT array = ...
+    if (CODE == CODE_INPUT) {
+        ++ IP;
+        mat_input(instr_channel(rt.in));
+    } else if (CODE == CODE_PRINT) {
+        ++ IP;
+        mat_print(instr_channel(rt.out));
+    } else if (CODE == CODE_READ) {
+        ++ IP;
+        mat_read();
+    } else {
+        mat_assign();
+}}
+
 void INSTR_MERGE(void) {
     if (prog_load(RAM + expr_str())) longjmp(rt.err_buffer, rt.error);
     rt.prog_changed = 0;
@@ -2032,53 +4905,46 @@ void INSTR_ON(void) {
 }}
 
 void INSTR_OPEN(void) {
-    // OPEN channel, name, mode
+    // OPEN channel, name, mode [, record_length]
     // channel and mode are integers, name is a string.
-    int ch = expr_num();
-    if (ch < 1 || ch > BUF_NUM) ERROR(ILLEGAL_CHANNEL);
-    if (rt.channels[ch] != NULL) ERROR(CHANNEL_BUSY);
+    int ch = chan_free(expr_num());
     EXPECT(',', COMMA);
     str_t name = expr_str();
     EXPECT(',', COMMA);
     int mode = expr_num();
-    if (mode < 0 || mode > 2) ERROR(ILLEGAL_MODE);
-    rt.channels[ch] = fopen(RAM + name, mode == 0 ? "r" : mode == 1 ? "w" : "a");
-    if (rt.channels[ch] == NULL) ERROR(FILE);
+    if (mode < 0 || mode > 6) ERROR(ILLEGAL_MODE);
+    if (mode == 4) {
+        // Binary file: OPEN channel, name, 4, record_length
+        EXPECT(',', COMMA);
+        int reclen = expr_num();
+        if (reclen < 1) ERROR(ILLEGAL_MODE);
+        if (!chan_open_binary(ch, RAM + name, reclen)) ERROR(FILE);
+    } else if (mode == 0) {
+        rt.chan[ch].file = fopen(RAM + name, "r");
+        if (rt.chan[ch].file == NULL) ERROR(FILE);
+        chan_map(ch);
+    } else if (mode == 3) {
+        if (!chan_open_ahead(ch, RAM + name)) ERROR(FILE);
+    } else if (mode >= 5) {
+        // Pipe from (5) or to (6) a command.
+        if (!chan_open_pipe(ch, RAM + name, mode == 6)) ERROR(FILE);
+    } else {
+        if (!chan_open_output(ch, RAM + name, mode == 2)) ERROR(FILE);
+    }
+    rt.chan[ch].name = strdup(RAM + name);
+    rt.chan[ch].mode = mode;
 }
 
 void INSTR_PRINT(void) {
-    int ch = instr_channel(stdout);
-    FILE *f = rt.channels[ch];
+    int ch = instr_channel(rt.out);
+    FILE *f = rt.chan[ch].file;
     int newline = 1;    // True if a newline has to be eventually printed.
     while (CODE != 0 && CODE != ':' && CODE != '\'') {
         // A print-list is a sequence of commas/semi-colons possibly repeated
         // and expressions: the latter should be separated by at least a comma
         // or by a semi-colon.
         if (CODE == ',') {
-            if (ch == 0) {
-                // Try to print a tab on a Linux terminal.
-                struct termios prev, curr;
-                tcgetattr(0, &prev);
-                curr = prev;                        // Init new settings.
-                curr.c_lflag &= ~(ICANON | ECHO);   // No Echo, no buffer.
-                tcsetattr(0, TCSANOW, &curr);       // Set up non waiting mode.
-                int i, j;
-                // Get the cursor position.
-                fputs("\033[6n", stdout);
-                // The terminal should answer "\033[j;iR", being i the column.
-                if (scanf("\033[%i;%iR", &j, &i) != 2) {
-                    // Failed! Use a standard tabulation.
-                    fputs("\t\t", stdout);
-                } else {
-                    i += 16 - i % 16;   // Tabulation interval = 16 positions.
-                    char *w = getenv("COLUMNS");
-                    const int WIDTH = w != NULL ? atoi(w) : 80;
-                    if (i < WIDTH) printf("\033[%iG", i); else putchar('\n');
-                }
-                tcsetattr(0, TCSANOW, &prev);       // Restore waiting mode.
-            } else {
-                fputs("\t", f);
-            }
+            if (ch == 0) term_tab(); else fputs("\t", f);
             ++ IP;
             newline = 0;
         } else if (CODE == ';') {
@@ -2089,37 +4955,67 @@ void INSTR_PRINT(void) {
             str_t s;
             expr();
             pop(&n, &s);
-            if (s == NIL) fprintf(f, "%g", n); else fputs(RAM + s, f);
+            if (ch == 0) {
+                char buf[32];
+                if (s == NIL) sprintf(buf, "%g", n);
+                term_puts(s == NIL ? buf : (char*)RAM + s);
+            } else {
+                if (s == NIL) fprintf(f, "%g", n); else fputs(RAM + s, f);
+            }
             newline = 1;
     }}
-    if (newline) fputc('\n', f);
-    fflush(f);
+    if (ch == 0) {
+        if (newline) term_putc('\n');
+        if (!rt.batch) fflush(f);
+    } else {
+        if (newline) fputc('\n', f);
+        // A write error, if any, is detected here but it may have been
+        // caused by a previous PRINT.
+        if (rt.chan[ch].wb != NULL && rt.chan[ch].wb->error) ERROR(WRITE);
+    }
+}
+
+void INSTR_PUT(void) {
+    // PUT #channel, [record], expression [TO width], ...
+    if (CODE != '#') ERROR(HASH);
+    int ch = instr_channel(rt.in);
+    off_t offset = chan_record(ch);
+    int reclen = rt.chan[ch].reclen;
+    char *rec = memset(chan_spare(reclen), 0, reclen);
+    for (int at = 0;;) {
+        num_t x;
+        str_t s;
+        expr();
+        pop(&x, &s);
+        if (s == NIL) {
+            if (at + sizeof(num_t) > reclen) ERROR(RECORD);
+            memcpy(rec + at, &x, sizeof(num_t));
+            at += sizeof(num_t);
+        } else {
+            int width = chan_field(ch, at);
+            strncpy(rec + at, RAM + s, width);
+            at += width;
+        }
+        if (CODE != ',') break;
+        ++ IP;
+    }
+    if (pwrite(fileno(rt.chan[ch].file), rec, reclen, offset) != reclen)
+        ERROR(WRITE);
+    rt.chan[ch].bytes += reclen;
+    ++ rt.chan[ch].lines;
 }
 
-void INSTR_RANDOMIZE(void) { srand(time(NULL) % RAND_MAX); }
+void INSTR_RANDOMIZE(void) { rt_srand(time(NULL) % RAND_MAX); }
 
 void INSTR_READ(void) {
-    /*  rt.data_next points to an instruction keyword, and in this case we
-        check against a DATA, else find the next DATA instruction if any, or
-        points to ',' or '\0' inside a DATA line. */
     for (;;) {
-        if (RAM[rt.data_next] == CODE_DATA || RAM[rt.data_next] == ',') {
-            ++ rt.data_next;   // Skip DATA or ','.
-        } else {
-            // Save current line pointers, instr_lookfor changes them!
-            addr_t ip0_saved = rt.ip0, ip_saved = IP;
-            IP = rt.data_next;
-            rt.data_next = instr_lookfor(CODE_DATA);
-            // Restore line pointers.
-            rt.ip0 = ip0_saved, IP = ip_saved;
-            if (rt.data_next == NIL) ERROR(OUT_OF_DATA);
-        }
-        rt.data_next = assign_item(rt.data_next);
+        rt.data_next = assign_item(instr_data());
         if (rt.data_next == NIL) ERROR(DATA);
         if (CODE != ',') break;
         ++ IP;  // Skip ','.
 }}
 
+void INSTR_REFRESH(void) { term_refresh(); }
 void INSTR_REM(void) { instr_skip_line(); }
 
 void INSTR_REPEAT(void) {
@@ -2135,7 +5031,12 @@ void INSTR_RESTORE(void) {
     }
 }
 
-void INSTR_RETURN(void) { rpop(&rt.ip0, &IP); }
+void INSTR_RETURN(void) {
+    // RETURN [expr]: from a function if it is running and either expr is
+    // given or no GOSUB is pending inside it, else from the last GOSUB.
+    extern int fn_return(void);
+    if (!fn_return()) rpop(&rt.ip0, &IP);
+}
 
 void INSTR_RUN(void) {
     rt_reset(RT_RESET_VARS);
@@ -2150,76 +5051,128 @@ void INSTR_SKIP(void) {
     instr_skip_line();
 }
 
+void INSTR_SORT(void) {
+    // SORT array [ON column] [DESC] [INDEX vector]
+    int rows, cols, col = 1, desc = 0;
+    addr_t v = sort_array(&rows, &cols);
+    if (CODE == CODE_ON) {
+        ++ IP;
+        col = expr_num();
+        if (col < 1 || col > cols) ERROR(SUBSCRIPT_RANGE);
+    }
+    if (token_word("DESC"))
+        desc = 1;
+    str_t index = NIL;
+    if (token_word("INDEX")) {
+        if (CODE != CODE_IDN) ERROR(NUMVAR);
+        index = PEEK(IP + 1);
+        IP += 1 + sizeof(addr_t);
+    }
+    sort_rows(v, rows, cols, col, desc, index);
+}
+
 void INSTR_STEP(void) { ERROR(ILLEGAL_INSTRUCTION); }
 void INSTR_STOP(void) { ERROR(STOP); }
-void INSTR_SYS(void) { system(RAM + expr_str()); }
+void INSTR_SYS(void) { rt.status = chan_status(system(RAM + expr_str())); }
 void INSTR_THEN(void) { ERROR(ILLEGAL_INSTRUCTION); }
 void INSTR_TO(void) { ERROR(ILLEGAL_INSTRUCTION); }
 void INSTR_TRACE(void) { rt.trace = expr_num(); }
 
-/** Execute the instruction at IP, advancing it to the first token of
-    the next instruction, even in case of error. The value of rt.error is
-    returned, in any case. */
-int instr_exec(void) {
+/** Advance IP from the end of an instruction to the first token of the next
+    one, or to NIL if END has been reached. */
+void instr_next(void) {
+    if (IP != NIL) {
+        /*  Here IP points to the first byte after the instruction, so a
+            comment or an instruction delimiter should be parsed here. */
+        if (CODE == '\'') {
+            // Skip comment
+            rt.ip0 = IP + strlen(RAM + IP) + 1;
+            instr_skip();
+        }
+        // IP should point to a delimiter between instructions or to the
+        // first token of a line (in case a jump occurred).
+        if (CODE == 0) instr_skip();
+        else if (LINE_TEXT(rt.ip0) != IP && CODE != ':' && CODE != CODE_THEN)
+            ERROR(SYNTAX);
+}}
+
+/** Execute the instruction at IP, advancing it to the first token of the
+    next instruction: errors are raised and not handled. */
+void instr_run(void) {
+    extern int fn_call(void);
     /// Table of all routines implementing instructions.
     static void (*Instructions[])(void) = {
 #       define I(label) &INSTR_##label,
 #       include "straybasic.h"
     };
+    byte_t opcode;
+    // Skip possible instruction separators.
+    while ((opcode = CODE) == ':' || opcode == CODE_THEN) ++ IP;
+    // A checkpoint asked by SIGUSR1 resumes from this statement: if it
+    // cannot be taken, the program goes on anyway.
+    if (rt.ckpt_signal && rt.fn_depth == 0 && !rt.parallel && rt.ip0 < rt.pp) {
+        extern int ckpt_try(const char*);
+        rt.ckpt_signal = 0;
+        int error = ckpt_try(rt.ckpt[0] != 0 ? rt.ckpt : CKPT_FILE);
+        if (error != 0)
+            fprintf(rt_msg(), "CHECKPOINT NOT TAKEN: %s\n", Errors[error]);
+    }
+    // A host may limit the statements a program executes.
+    if (rt.budget > 0 && -- rt.budget == 0) ERROR(BUDGET);
+    // Trace statement execution if required.
+    if (rt.trace) {
+        fprintf(rt_msg(), "\nEXECUTE % 4i ", PEEK(LINE_NUM(rt.ip0)));
+        addr_t p = IP;
+        while ((p = token_dump(p, rt.msg)) != NIL)
+            ;
+        fputc('\n', rt.msg);
+    }
+    if (opcode > CODE_STARTKEYWORD && opcode < CODE_ENDKEYWORD) {
+        // Skip the keyword and execute the corresponding INSTR_ routine.
+        ++ IP; (*Instructions[opcode - CODE_STARTKEYWORD - 1])();
+    } else
+    if (opcode == CODE_IDN || opcode == CODE_IDNS) {
+        // Instruction of the form "var = expr", or a procedure call.
+        if (!fn_call()) INSTR_LET();
+    } else {
+        ERROR(ILLEGAL_INSTRUCTION);
+    }
+    instr_next();
+}
+
+/** Execute the instruction at IP, advancing it to the first token of
+    the next instruction, even in case of error. The value of rt.error is
+    returned, in any case. */
+int instr_exec(void) {
+    extern void fn_unwind(int);
     // Save the current exception buffer, since instr_exec may recurse.
     jmp_buf error_saved;
     memcpy(error_saved, rt.err_buffer, sizeof(jmp_buf));
     rt_reset(0);    // Reset volatile data (stacks, etc.).
+    // Functions called by the instruction are left if an error occurs.
+    int fn_depth = rt.fn_depth;
     if (setjmp(rt.err_buffer) == 0) {
-        volatile byte_t opcode;
-        // Skip possible instruction separators.
-        while ((opcode = CODE) == ':' || opcode == CODE_THEN) ++ IP;
-        // Trace statement execution if required.
-        if (rt.trace) {
-            fprintf(stderr, "\nEXECUTE % 4i ", PEEK(LINE_NUM(rt.ip0)));
-            addr_t p = IP;
-            while ((p = token_dump(p, stderr)) != NIL)
-                ;
-            fputc('\n', stderr);
-        }
-        if (opcode > CODE_STARTKEYWORD && opcode < CODE_ENDKEYWORD) {
-            // Skip the keyword and execute the corresponding INSTR_ routine.
-            ++ IP; (*Instructions[opcode - CODE_STARTKEYWORD - 1])();
-        } else
-        if (opcode == CODE_IDN || opcode == CODE_IDNS) {
-            INSTR_LET();    // Instruction of the form "var = expr".
-        } else {
-            ERROR(ILLEGAL_INSTRUCTION);
-        }
-        // If END has been reached, IP == NIL.
-        if (IP != NIL) {
-            /*  Here IP points to the first byte after the instruction, so a
-                comment or an instruction delimiter should be parsed here. */
-            if (CODE == '\'') {
-                // Skip comment
-                rt.ip0 = IP + strlen(RAM + IP) + 1;
-                instr_skip();
-            }
-            // IP should point to a delimiter between instructions or to the
-            // first token of a line (in case a jump occurred).
-            if (CODE == 0) instr_skip();
-            else if (LINE_TEXT(rt.ip0) != IP && CODE != ':' && CODE != CODE_THEN)
-                ERROR(SYNTAX);
-    }} else {
-        // Check against the last ON ERROR statement, if any.
-        if (rt.on_error == NIL) {
+        instr_run();
+    } else {
+        // Check against the last ON ERROR statement, if any: an exhausted
+        // budget cannot be handled by the program.
+        if (rt.on_error == NIL || rt.error == ERROR_BUDGET) {
             // Default error handling: print a message and stop.
             int line = PEEK(LINE_NUM(rt.ip0));
             if (line >= LINE_MIN && line <= LINE_MAX && rt.ip0 < rt.pp)
-                fprintf(stderr, "LINE %i: ", line);
-            if (rt.error > 0 && rt.error <= ERROR_ZERO) {
-                puts(Errors[rt.error]);
+                fprintf(rt_msg(), "LINE %i: ", line);
+            if (rt.error > 0 && rt.error < sizeof(Errors)/sizeof(*Errors)) {
+                fprintf(rt.out, "%s\n", Errors[rt.error]);
             } else if (rt.error != 0)
-                printf("ERROR #%i\n", rt.error);
+                fprintf(rt.out, "ERROR #%i\n", rt.error);
+            rt.term.col = 1;
+            rt.fault = rt.error;
+            fn_unwind(fn_depth);
             IP = NIL;   // Definitely stops program execution.
             rt_reset(RT_RESET_FILES);
         } else {
             // User defined error handling: jump to the ON ERROR line.
+            fn_unwind(fn_depth);
             rt.ip0 = rt.on_error;
             LINE_START;
             // Reset the error condition (to avoid infinite loop), but before
@@ -2233,75 +5186,1279 @@ int instr_exec(void) {
 }
 
 /// \}
-/// \defgroup FN User Defined Function Evaluation
+/** \defgroup FN User Defined Function Evaluation
+
+    A function is defined either by a single line "DEF name(params) = expr",
+    or by the lines following "DEF name(params)" up to FNEND, which return a
+    value by "RETURN expr". Each call pushes a frame on rt.frame, and its
+    parameters, along with the variables declared by LOCAL, are created at
+    the end of the variable list and bound to their names in rt.local, so
+    that they hide the variables with the same names until the function
+    returns, when they are deleted. */
 /// \{
 
-/** Looks for a user defined function with the provided name: if not found, then
-    return 0, else 1. IP is assumed to point to the CODE_STRLIT byte of the
-    function's name, so that, if the function is found, the actual parameter list
-    is parsed from IP + sizeof(str_t) + 1 and matched to the formal parameter
-    list in the DEF instruction. If the match suceeds then the expression in
-    the DEF definition is executed and the value pushed on the stack. */
-int fn_eval(str_t name) {
-    int ok = 0;     // a priori not found.
+/** Create a local variable of the running function, with the given name,
+    type and dimensions, and return its address. */
+addr_t fn_bind(str_t name, int type, num_t d1, num_t d2) {
+    if (rt.bind_num == rt.bind_size) {
+        int size = rt.bind_size == 0 ? 64 : 2 * rt.bind_size;
+        bind_t *bind = realloc(rt.bind, size * sizeof(bind_t));
+        if (bind == NULL) ERROR(OUT_OF_VARIABLES);
+        rt.bind = bind;
+        rt.bind_size = size;
+    }
+    if (rt.local == NULL && (rt.local = calloc(RAM_SIZE, sizeof(int))) == NULL)
+        ERROR(OUT_OF_VARIABLES);
+    addr_t v = rt.vp;
+    var_create(name, type, d1, d2, 0, 0, 0);
+    bind_t *b = rt.bind + rt.bind_num;
+    b->name = name;
+    b->addr = v;
+    b->prev = rt.local[name] - 1;
+    rt.local[name] = ++ rt.bind_num;
+    return v;
+}
+
+/// Delete the last local variable created, unhiding what it was hiding.
+void fn_unbind(void) {
+    bind_t *b = rt.bind + -- rt.bind_num;
+    rt.local[b->name] = b->prev + 1;
+    var_delete(b->addr);
+}
+
+/** If name is a numerical variable local to the running function, turn it
+    into a FOR index, as required by FOR, and return its address; else return
+    NIL. */
+addr_t fn_for(str_t name) {
+    if (rt.local == NULL || rt.fn_depth == 0
+    ||  rt.local[name] <= rt.frame[rt.fn_depth - 1].bind)
+        return NIL;
+    bind_t *b = rt.bind + rt.local[name] - 1;
+    if (VAR_TYPE(b->addr) != VAR_NUM) return NIL;
+    var_delete(b->addr);
+    b->addr = rt.vp;
+    var_create(name, VAR_FOR, 0, 0, 1, 0, 0);
+    return b->addr;
+}
+
+/// Leave the innermost running function, but for the position of IP.
+void fn_drop(void) {
+    frame_t *f = rt.frame + -- rt.fn_depth;
+    while (rt.bind_num > f->bind) fn_unbind();
+    rt.rsp = f->rsp;
+}
+
+/// Leave the running functions until depth of them are left.
+void fn_unwind(int depth) {
+    while (rt.fn_depth > depth) fn_drop();
+}
+
+/** If a function is running and either an expression follows or no GOSUB
+    is pending inside it, then push the expression, or the default value,
+    as value of the function and return 1; else return 0. */
+int fn_return(void) {
+    if (rt.fn_depth == 0) return 0;
+    frame_t *f = rt.frame + rt.fn_depth - 1;
+    if (CODE == 0 || CODE == ':' || CODE == '\'') {
+        if (rt.rsp > f->rsp) return 0;
+        // The value of a function left without a value.
+        if (f->type == CODE_IDNS) oper_empty_string(); else push_num(0);
+    } else {
+        expr();     // It may grow, hence move, rt.frame.
+    }
+    rt.frame[rt.fn_depth - 1].returned = 1;
+    return 1;
+}
+
+/** If IP points to PURE followed by the name of a function, skip it and
+    return 1, else return 0. */
+int fn_pure(void) {
+    if (CODE != CODE_IDN || strcmp(RAM + PEEK(IP + 1), "PURE") != 0) return 0;
+    byte_t next = RAM[IP + 1 + sizeof(str_t)];
+    if (next != CODE_IDN && next != CODE_IDNS) return 0;
+    IP += 1 + sizeof(str_t);
+    return 1;
+}
+
+/** Return the user defined function with the provided name, or NULL if it is
+    not defined: its DEF is looked for in the program only the first time. */
+fn_t *fn_find(str_t name) {
+    for (int i = 0; i < rt.fn_num; ++ i)
+        if (rt.fn[i].name == name) return rt.fn + i;
     // We'll use instr_lookfor that alter pointers to the line under execution.
     addr_t ip0_saved = rt.ip0, ip_saved = IP;
     // Start looking for DEF FN from the very first program line.
     rt.ip0 = rt.pp0;
     LINE_START;
-    while ((instr_lookfor(CODE_DEF)) != NIL) {
+    int pure;
+    for (;;) {
+        if (IP == NIL || instr_lookfor(CODE_DEF) == NIL) {
+            rt.ip0 = ip0_saved;
+            IP = ip_saved;
+            return NULL;
+        }
+        pure = fn_pure();
         // Check the name of the function
         if (CODE != CODE_IDN && CODE != CODE_IDNS) ERROR(IDENTIFIER);
-        if (STREQ(PEEK(IP + 1), name)) {
-            // Found! We swap IP and ip_saved since expr needs to be applied
-            // to the actual parameters, so IP should point to them.
-            addr_t tmp = IP; IP = ip_saved; ip_saved = tmp;
-            // Skip the function name both in the call and in the DEF.
-            IP += 1 + sizeof(str_t);
-            ip_saved += 1 + sizeof(str_t);
-            if (CODE == '(') {
-                if (RAM[ip_saved] != '(') ERROR(OPENEDPAR);
-                ++ IP;          // Skip '(' in the actual parameter list.
-                ++ ip_saved;    // Skip '(' in the formal parameter list.
-                /* Parse actual and formal parameter lists and assign values
-                    to the formal parameters. */
-                for (;;) {
-                    // Parse the type of the formal parameter.
-                    if (RAM[ip_saved] == CODE_IDN) {  // Number.
-                        addr_t v = var_insert(ip_saved + 1);
-                        POKE_NUM(VAR_ADDR(v), expr_num());
-                    } else
-                    if (RAM[ip_saved] == CODE_IDNS) { // String.
-                        addr_t v = var_insert(ip_saved + 1);
-                        assign_string(v, VAR_ADDR(v), expr_str());
-                    } else {
-                        ERROR(IDENTIFIER);
-                    }
-                    ip_saved += 1 + sizeof(str_t);  // Skip the parsed name.
-                    if (RAM[ip_saved] != ',') break;
-                    ++ ip_saved;
-                    // Also in the actual parameter list we expect a comma.
-                    EXPECT(',', COMMA);
-                }
-                EXPECT(')', CLOSEDPAR);
-                // We also expect ')' to close the actual parameter list.
-                if (RAM[ip_saved++] != ')') ERROR(CLOSEDPAR);
-            }
-            // Swap again IP and ip_saved so that IP points again to the
-            // formal parameters list.
-            tmp = IP; IP = ip_saved; ip_saved = tmp;
-            // Now evaluate the function's body.
-            EXPECT(CODE_EQ, ASSIGNMENT);
-            expr();
-            // Final swap to restore IP after the actual parameters list.
-            IP = ip_saved;
-            ok = 1;
-            break;
+        if (STREQ(PEEK(IP + 1), name)) break;
+    }
+    if (pure) {
+        // Only numbers are memoized, and as many as a memo_t contains.
+        int n = 0;
+        if (CODE != CODE_IDN) ERROR(PURE);
+        for (addr_t a = IP + 1 + sizeof(str_t); RAM[a] != 0 && RAM[a] != CODE_EQ
+             && RAM[a] != ')'; a = token_skip(a)) {
+            if (RAM[a] == CODE_IDNS) ERROR(PURE);
+            if (RAM[a] == CODE_IDN && ++ n > FN_MEMO_ARGS) ERROR(PURE);
     }}
-    // Done! We restore line pointers before return.
+    if (rt.fn_num == rt.fn_size) {
+        int size = rt.fn_size == 0 ? 16 : 2 * rt.fn_size;
+        fn_t *fn = realloc(rt.fn, size * sizeof(fn_t));
+        if (fn == NULL) ERROR(OUT_OF_VARIABLES);
+        rt.fn = fn;
+        rt.fn_size = size;
+    }
+    fn_t *f = rt.fn + rt.fn_num ++;
+    f->name = name;
+    f->ip0 = rt.ip0;
+    f->ip = IP + 1 + sizeof(str_t);
+    f->memo = NULL;
+    f->pure = pure;
+    f->hits = f->misses = 0;
     rt.ip0 = ip0_saved;
     IP = ip_saved;
-    return ok;
+    return f;
+}
+
+/** Return the slot of the memo of the PURE function f for the arguments
+    on the stack from args on, which are stored into key. */
+memo_t *fn_memo(fn_t *f, addr_t args, num_t key[FN_MEMO_ARGS]) {
+    if (f->memo == NULL && (f->memo = calloc(FN_MEMO, sizeof(memo_t))) == NULL)
+        ERROR(OUT_OF_VARIABLES);
+    memset(key, 0, FN_MEMO_ARGS * sizeof(num_t));
+    for (int i = 0; args < rt.sp; ++ i, args += sizeof(str_t) + sizeof(num_t))
+        key[i] = PEEK_NUM(args + sizeof(str_t));
+    // FNV-1a hash of the bytes of the arguments.
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < FN_MEMO_ARGS * sizeof(num_t); ++ i)
+        h = (h ^ ((byte_t*)key)[i]) * 16777619u;
+    return f->memo + h % FN_MEMO;
+}
+
+/** Looks for a user defined function with the provided name: if not found, then
+    return 0, else 1. IP is assumed to point to the CODE_STRLIT byte of the
+    function's name, so that, if the function is found, the actual parameter list
+    is parsed from IP + sizeof(str_t) + 1 and matched to the formal parameter
+    list in the DEF instruction. If the match suceeds then the function is
+    executed and its value pushed on the stack. If the function is PURE, its
+    value may be found in its memo, without executing it. */
+int fn_eval(str_t name) {
+    int type = CODE;
+    fn_t *fn = fn_find(name);
+    if (fn == NULL) return 0;
+    // IP points to the actual parameters and def to the formal ones.
+    int k = fn - rt.fn;
+    addr_t def0 = fn->ip0, def = fn->ip;
+    IP += 1 + sizeof(str_t);
+    // The actual parameters are pushed on the stack, from args on: there must
+    // be as many as the formal ones, so that a missing one raises a COMMA
+    // error and an extra one a CLOSEDPAR error, before they are bound.
+    addr_t args = rt.sp, params = def;
+    if (CODE == '(') {
+        if (RAM[def] != '(') ERROR(OPENEDPAR);
+        ++ IP;          // Skip '(' in the actual parameter list.
+        ++ def;         // Skip '(' in the formal parameter list.
+        for (;;) {
+            // Parse the type of the formal parameter.
+            if (RAM[def] == CODE_IDN) {
+                push_num(expr_num());
+            } else if (RAM[def] == CODE_IDNS) {
+                str_t s = expr_str();
+                push_str(s);
+            } else {
+                ERROR(IDENTIFIER);
+            }
+            def += 1 + sizeof(str_t);   // Skip the parsed name.
+            if (RAM[def] != ',') break;
+            ++ def;
+            // Also in the actual parameter list we expect a comma.
+            EXPECT(',', COMMA);
+        }
+        EXPECT(')', CLOSEDPAR);
+        // We also expect ')' to close the actual parameter list.
+        if (RAM[def++] != ')') ERROR(CLOSEDPAR);
+    } else if (RAM[def] == '(') ERROR(OPENEDPAR);
+    // A PURE function may have already been called with these arguments.
+    num_t key[FN_MEMO_ARGS];
+    memo_t *memo = NULL;
+    fn = rt.fn + k;     // The arguments may have called functions found now.
+    if (fn->pure) {
+        memo = fn_memo(fn, args, key);
+        if (memo->used && memcmp(memo->arg, key, sizeof(key)) == 0) {
+            ++ fn->hits;
+            rt.sp = args;
+            push_num(memo->value);
+            return 1;
+        }
+        ++ fn->misses;
+    }
+    // A variable hidden by LET is created before the locals of the call, and
+    // what its body creates, are: they would overwrite it.
+    if (rt.hidden != NIL && rt.vp == rt.hidden) rt.vp += VAR_SIZE(rt.hidden);
+    // Push a frame for the call, IP pointing after the actual parameters.
+    if (rt.fn_depth == rt.frame_size) {
+        if (rt.fn_depth == FN_DEPTH) ERROR(TOO_MANY_CALLS);
+        int size = rt.frame_size == 0 ? 16 : 2 * rt.frame_size;
+        if (size > FN_DEPTH) size = FN_DEPTH;
+        frame_t *frame = realloc(rt.frame, size * sizeof(frame_t));
+        if (frame == NULL) ERROR(TOO_MANY_CALLS);
+        rt.frame = frame;
+        rt.frame_size = size;
+    }
+    frame_t *f = rt.frame + rt.fn_depth ++;
+    f->ip0 = rt.ip0;
+    f->ip = IP;
+    f->rsp = rt.rsp;
+    f->bind = rt.bind_num;
+    f->type = type;
+    f->returned = 0;
+    // Bind the values of the actual parameters to the formal ones.
+    rt.sp = args;
+    if (RAM[params] == '(') {
+        ++ params;
+        for (addr_t a = args; ; a += sizeof(str_t) + sizeof(num_t)) {
+            str_t s = PEEK(a);
+            num_t n = PEEK_NUM(a + sizeof(str_t));
+            if (RAM[params] == CODE_IDN) {
+                POKE_NUM(VAR_ADDR(fn_bind(PEEK(params + 1), VAR_NUM, 0, 0)), n);
+            } else {
+                addr_t v = fn_bind(PEEK(params + 1), VAR_STR, 0, 0);
+                assign_string(v, VAR_ADDR(v), s);
+            }
+            params += 1 + sizeof(str_t);
+            if (RAM[params++] != ',') break;
+    }}
+    f->sp = rt.sp;
+    f->tsp = rt.tsp;
+    f->estack_next = rt.estack_next;
+    f->vec_used = rt.vec_used;
+    // Now execute the function's body.
+    rt.ip0 = def0;
+    IP = def;
+    if (CODE == CODE_EQ) {
+        ++ IP;
+        expr();
+    } else {
+        // The body starts after the DEF instruction and ends at FNEND.
+        int depth = rt.fn_depth;
+        if (CODE == 0) instr_skip();
+        while (!rt.frame[depth - 1].returned) {
+            // END, or the end of the program, would leave the function.
+            if (IP == NIL || rt.fn_depth != depth) ERROR(FNEND);
+            rt_reset(0);
+            instr_run();
+    }}
+    // Check the type of the value.
+    if (type == CODE_IDNS) { str_t s = pop_str(); push_str(s); }
+    else push_num(pop_num());
+    if (memo != NULL) {
+        // Nested calls may have moved rt.fn, but not the memos.
+        memcpy(memo->arg, key, sizeof(key));
+        memo->value = PEEK_NUM(tos_num());
+        memo->used = 1;
+    }
+    // Back to the caller, after the actual parameters list.
+    f = rt.frame + rt.fn_depth - 1;
+    rt.ip0 = f->ip0;
+    IP = f->ip;
+    fn_drop();
+    return 1;
+}
+
+/** If IP points to the name of a user defined function, not followed by "=",
+    and no variable has that name, then call the function as a procedure,
+    forgetting its value, and return 1; else return 0 and leave IP alone. */
+int fn_call(void) {
+    str_t name = PEEK(IP + 1);
+    if (RAM[IP + 1 + sizeof(str_t)] == CODE_EQ || var_find(name) != NIL)
+        return 0;
+    if (!fn_eval(name)) return 0;
+    num_t n;
+    str_t s;
+    pop(&n, &s);
+    return 1;
+}
+
+/// \}
+/** \defgroup PAR Parallel Loops
+
+    "FOR var = a TO b [STEP c] PARALLEL [REDUCE v op, ...]" splits the
+    iterations of the loop, up to the matching "NEXT var", into chunks, which
+    are run by a pool of worker threads, each one taking the first chunk not
+    yet taken. A worker runs the body on its own copy of rt, so that stacks,
+    temporary strings and scalar variables are private to it: when all
+    chunks are done, the elements of numerical arrays changed by the workers
+    are copied into the variables of the program, and each variable v listed
+    after REDUCE, which starts each chunk as 0 (+), 1 (*), or the largest
+    (MIN) or smallest (MAX) number, is combined by op with the values it
+    took at the end of the chunks, in their order. Neither the chunks nor
+    the seed of RND in each of them depend on the number of threads, so that
+    the results don't either. */
+/// \{
+
+/// The pool of worker threads and the loop they are running.
+typedef struct par {
+    pthread_t thread[PAR_THREADS];
+    int threads, ids, quit;         ///< quit is set to end the workers.
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned long job;          ///< Incremented to start running a loop.
+    int running;                ///< Workers not done with the loop yet.
+    struct runtime *main;       ///< The rt of the thread running the FOR.
+    struct runtime *copy[PAR_THREADS];  ///< The rt of each worker.
+    // The loop: var takes n values from "from" by step, in chunks.
+    str_t var;
+    addr_t body0, body, line1;  ///< The body and the line of NEXT.
+    num_t from, step;
+    long n;
+    int chunks, next;           ///< next is the first chunk not yet taken.
+    unsigned seed;
+    // Value of red[i] at the end of chunk c is partial[c * reduce + i].
+    int reduce;
+    struct { str_t name; int op; } red[PAR_REDUCE];
+    num_t *partial;
+    // The error raised by the first chunk which failed, if any.
+    int error, error_chunk;
+    addr_t error_ip0;
+} par_t;
+
+/// Value a variable reduced by op starts each chunk with.
+num_t par_start(int op) {
+    return op == CODE_PLUS ? 0 : op == CODE_MUL ? 1
+        : op == CODE_MIN ? INFINITY : -INFINITY;
+}
+
+/// Combine by op the values x and y of a reduced variable.
+num_t par_reduce(int op, num_t x, num_t y) {
+    return op == CODE_PLUS ? x + y : op == CODE_MUL ? x * y
+        : op == CODE_MIN ? (y < x ? y : x) : (y > x ? y : x);
+}
+
+/** Run the iterations of chunk c in a worker: return 0, or the error which
+    stopped it. */
+int par_chunk(par_t *p, int c) {
+    if (setjmp(rt.err_buffer) != 0) return rt.error;
+    long k0 = p->n * c / p->chunks, k1 = p->n * (c + 1) / p->chunks;
+    rt.seed = p->seed + c * 2654435761u;
+    for (int i = 0; i < p->reduce; ++ i)
+        POKE_NUM(VAR_ADDR(var_find(p->red[i].name)), par_start(p->red[i].op));
+    // The bound is half a step after the last value, against rounding.
+    addr_t v = var_find(p->var), vp = rt.vp;
+    POKE_NUM(VAR_ADDR(v), p->from + k0 * p->step);
+    POKE_NUM(VAR_TO(v), p->from + (k1 - 1) * p->step + p->step / 2);
+    rt.ip0 = p->body0;
+    IP = p->body;
+    if (CODE == 0) instr_skip();
+    addr_t rsp = rt.rsp;
+    int depth = rt.fn_depth;
+    while (var_for_check(v)) {
+        // Only GOSUBs and function calls may leave the lines of the loop.
+        if (IP == NIL || (rt.rsp == rsp && rt.fn_depth == depth
+        &&  (rt.ip0 < p->body0 || rt.ip0 > p->line1)))
+            ERROR(PARALLEL);
+        rt_reset(0);
+        instr_run();
+        // New variables, or longer strings, may move the index.
+        if (rt.vp != vp) { v = var_find(p->var); vp = rt.vp; }
+    }
+    for (int i = 0; i < p->reduce; ++ i) {
+        addr_t r = var_find(p->red[i].name);
+        p->partial[c * p->reduce + i] = PEEK_NUM(VAR_ADDR(r));
+    }
+    return 0;
+}
+
+/// Copy size bytes from p to a new block, or return NULL if p is NULL.
+void *par_copy(const void *p, size_t size) {
+    void *q = p == NULL ? NULL : malloc(size);
+    if (q != NULL) memcpy(q, p, size);
+    return q;
+}
+
+/** Free the temporary arrays, patterns, functions and frames of the current
+    rt, which are allocated outside the RAM. */
+void rt_release(void) {
+    free(rt.vec);
+    for (int i = 0; i < PAT_CACHE; ++ i)
+        if (rt.pat[i] != NULL) { free(rt.pat[i]->src); free(rt.pat[i]); }
+    rt_forget();
+    free(rt.fn);
+    free(rt.frame);
+    free(rt.bind);
+    free(rt.local);
+}
+
+/** Run the chunks of the current loop in the worker id, on a copy of the rt
+    of the thread running the FOR, until none is left. */
+void par_work(par_t *p, int id) {
+    memcpy(&rt, p->main, sizeof(rt));
+    rt.parallel = 1;
+    rt.on_error = NIL;
+    // Private copies of what is allocated outside the RAM: no files, no screen.
+    chan_t chan = rt.chan[0];
+    rt.chan = &chan;
+    rt.chan_num = rt.chan_max = 1;
+    rt.screen[0] = rt.screen[1] = NULL;
+    rt.vec = NULL;
+    rt.vec_used = rt.vec_size = 0;
+    memset(rt.pat, 0, sizeof(rt.pat));
+    rt.fn = NULL;
+    rt.fn_num = rt.fn_size = 0;
+    rt.frame = par_copy(rt.frame, rt.frame_size * sizeof(frame_t));
+    rt.bind = par_copy(rt.bind, rt.bind_size * sizeof(bind_t));
+    rt.local = par_copy(rt.local, RAM_SIZE * sizeof(int));
+    int error = 0;
+    if ((rt.frame_size > 0 && rt.frame == NULL)
+    ||  (rt.bind_size > 0 && rt.bind == NULL)
+    ||  (p->main->local != NULL && rt.local == NULL))
+        error = ERROR_OUT_OF_VARIABLES;
+    for (int c = 0; error == 0; ) {
+        pthread_mutex_lock(&p->lock);
+        c = p->error != 0 ? p->chunks : p->next ++;
+        pthread_mutex_unlock(&p->lock);
+        if (c >= p->chunks) break;
+        if ((error = par_chunk(p, c)) != 0) {
+            pthread_mutex_lock(&p->lock);
+            if (p->error == 0 || c < p->error_chunk) {
+                p->error = error;
+                p->error_chunk = c;
+                p->error_ip0 = rt.ip0;
+            }
+            pthread_mutex_unlock(&p->lock);
+    }}
+    rt_release();
+    rt.chan = NULL;
+}
+
+/// Worker thread: run each loop started by par_for.
+void *par_worker(void *arg) {
+    par_t *p = arg;
+    // Signals are for the main thread.
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_mutex_lock(&p->lock);
+    int id = p->ids ++;
+    rt_current = p->copy[id];
+    for (unsigned long job = 0; ; ) {
+        while (p->job == job) pthread_cond_wait(&p->start, &p->lock);
+        job = p->job;
+        pthread_mutex_unlock(&p->lock);
+        if (p->quit) return NULL;
+        par_work(p, id);
+        pthread_mutex_lock(&p->lock);
+        if (-- p->running == 0) pthread_cond_signal(&p->done);
+}}
+
+/** Return the pool of worker threads, creating it the first time: there are
+    as many workers as processors, up to PAR_THREADS. */
+par_t *par_pool(void) {
+    if (rt.par != NULL) return rt.par;
+    par_t *p = calloc(1, sizeof(par_t));
+    if (p == NULL) ERROR(OUT_OF_VARIABLES);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+    // Each worker runs the loops on its own rt, allocated here.
+    if (n < 1) n = 1;
+    while (p->threads < n && p->threads < PAR_THREADS
+    &&  (p->copy[p->threads] = malloc(sizeof(struct runtime))) != NULL
+    &&  pthread_create(&p->thread[p->threads], NULL, par_worker, p) == 0)
+        ++ p->threads;
+    if (p->threads < PAR_THREADS) free(p->copy[p->threads]);
+    if (p->threads == 0) {
+        free(p);
+        ERROR(OUT_OF_VARIABLES);
+    }
+    return rt.par = p;
+}
+
+/// End the worker threads of the pool p, if any, and free it.
+void par_free(par_t *p) {
+    if (p == NULL) return;
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    ++ p->job;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->threads; ++ i) {
+        pthread_join(p->thread[i], NULL);
+        free(p->copy[i]);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    free(p);
+}
+
+/** Copy into the variables the elements of numerical arrays changed by the
+    worker w, that is which differ from their values orig before the loop:
+    an element changed by several workers is not detected, and gets the value
+    of the last one merged. */
+void par_merge(struct runtime *w, const byte_t *orig) {
+    for (addr_t v = rt.vp0; v < rt.vp; v += VAR_SIZE(v)) {
+        int type = VAR_TYPE(v);
+        if (!(type & VAR_NUM) || !(type & (VAR_VEC|VAR_MAT))) continue;
+        // The array is in the same place, unless variables of w moved.
+        str_t name = PEEK(VAR_NAME(v));
+        addr_t u = v;
+        if (u >= w->vp || peek(w->ram + VAR_NAME(u)) != name)
+            for (u = rt.vp0; u < w->vp && peek(w->ram + VAR_NAME(u)) != name; )
+                u += peek(w->ram + u);
+        if (u >= w->vp) continue;
+        addr_t a = var_items(v);
+        long n = PEEK(VAR_ADDR(v));
+        if (type & VAR_MAT) n *= PEEK(VAR_ADDR(v) + sizeof(addr_t));
+        num_t *x = (num_t*)(w->ram + u + (a - v)), *y = (num_t*)(RAM + a);
+        const num_t *x0 = (const num_t*)(orig + (a - rt.vp0));
+        for (long i = 0; i < n; ++ i)
+            if (memcmp(x + i, x0 + i, sizeof(num_t)) != 0) y[i] = x[i];
+}}
+
+/** Called by FOR, with IP after PARALLEL, once the variable v of the loop has
+    been set: parse the REDUCE list and return 0 if the loop is to be run as
+    usual, else run it by the workers and return 1, with IP after its NEXT. */
+int par_for(addr_t v) {
+    struct { str_t name; int op; } red[PAR_REDUCE];
+    int reduce = 0;
+    if (token_word("REDUCE")) for (;;) {
+        if (reduce == PAR_REDUCE) ERROR(SYNTAX);
+        if (CODE != CODE_IDN) ERROR(NUMVAR);
+        str_t name = PEEK(IP + 1);
+        IP += 1 + sizeof(str_t);
+        int op = CODE;
+        if (op != CODE_PLUS && op != CODE_MUL && op != CODE_MIN && op != CODE_MAX)
+            ERROR(SYNTAX);
+        ++ IP;
+        addr_t r = var_find(name);
+        if (r == NIL) var_create(name, VAR_NUM, 0, 0, 0, 0, 0);
+        else if (VAR_TYPE(r) != VAR_NUM) ERROR(NUMVAR);
+        red[reduce].name = name;
+        red[reduce ++].op = op;
+        if (CODE != ',') break;
+        ++ IP;
+    }
+    // Inside a worker, loops are run as usual.
+    if (rt.parallel) return 0;
+    addr_t va = VAR_ADDR(v);
+    num_t from = PEEK_NUM(va), to = PEEK_NUM(VAR_TO(v));
+    num_t step = PEEK_NUM(VAR_STEP(v));
+    if (step == 0) ERROR(DOMAIN);
+    long n = (to - from) / step >= 0 ? floor((to - from) / step) + 1 : 0;
+    // NEXT jumps to the body, which ends at the matching NEXT.
+    addr_t body0 = rt.ip0, body = IP;
+    POKE(va + 3*sizeof(num_t), body0);
+    POKE(va + 3*sizeof(num_t) + sizeof(addr_t), body);
+    str_t name = PEEK(VAR_NAME(v));
+    do {
+        if (instr_lookfor(CODE_NEXT) == NIL) ERROR(FOR_WITHOUT_NEXT);
+        EXPECT(CODE_IDN, NUMVAR);
+    } while (name != PEEK(IP));
+    IP += sizeof(str_t);
+    if (n == 0) return 1;
+    par_t *p = par_pool();
+    p->main = &rt;
+    p->var = name;
+    p->body0 = body0;
+    p->body = body;
+    p->line1 = rt.ip0;
+    p->from = from;
+    p->step = step;
+    p->n = n;
+    p->chunks = n < PAR_CHUNKS ? n : PAR_CHUNKS;
+    p->next = 0;
+    p->seed = rt_rand();
+    p->reduce = reduce;
+    memcpy(p->red, red, sizeof(red));
+    p->error = 0;
+    p->partial = malloc((p->chunks * reduce + 1) * sizeof(num_t));
+    // The variables before the loop, to find what the workers change.
+    byte_t *orig = malloc(rt.vp - rt.vp0 + 1);
+    if (p->partial == NULL || orig == NULL) {
+        free(p->partial);
+        free(orig);
+        ERROR(OUT_OF_VARIABLES);
+    }
+    memcpy(orig, RAM + rt.vp0, rt.vp - rt.vp0);
+    // A break is served once the workers are done.
+    sigset_t set, saved;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, &saved);
+    pthread_mutex_lock(&p->lock);
+    p->running = p->threads;
+    ++ p->job;
+    pthread_cond_broadcast(&p->start);
+    while (p->running > 0) pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    // The statements executed by the workers are charged to the budget.
+    if (rt.budget > 0) {
+        long used = 0;
+        for (int i = 0; i < p->threads; ++ i) used += rt.budget - p->copy[i]->budget;
+        rt.budget = used < rt.budget ? rt.budget - used : 1;
+    }
+    if (p->error == 0) {
+        for (int i = 0; i < p->threads; ++ i) par_merge(p->copy[i], orig);
+        for (int i = 0; i < reduce; ++ i) {
+            addr_t r = VAR_ADDR(var_find(red[i].name));
+            num_t x = PEEK_NUM(r);
+            for (int c = 0; c < p->chunks; ++ c)
+                x = par_reduce(red[i].op, x, p->partial[c * reduce + i]);
+            POKE_NUM(r, x);
+        }
+        // The index is left as by the last NEXT.
+        POKE_NUM(VAR_ADDR(var_find(name)), from + n * step);
+    }
+    free(p->partial);
+    free(orig);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (p->error != 0) {
+        rt.ip0 = p->error_ip0;
+        longjmp(rt.err_buffer, rt.error = p->error);
+    }
+    return 1;
+}
+
+/// \}
+/** \defgroup CKPT Checkpoints
+
+    A checkpoint file is a snapshot of a running program, which can be resumed
+    by "straybasic --resume file" from the statement where it was taken: only
+    the live regions of the RAM are saved (strings, program, variables and
+    return stack), along with the registers and the name, mode and position of
+    each open file. It is written by a single write on a temporary file which
+    then replaces the old one, so that a crash never leaves a half written
+    checkpoint, and it is restored by a single read.
+
+    Files opened for input are reopened at the recorded position; output files
+    are cut to their size at the checkpoint and written from there, so that
+    what was written after it is dropped. The calls of functions cannot be
+    saved, neither the pipes, nor the screen buffer. RND is seeded afresh at
+    the checkpoint with a number saved in it, so that the resumed program
+    draws the same numbers the original one draws after the checkpoint. */
+/// \{
+
+/// Header of a checkpoint file, followed by the RAM regions and the files.
+typedef struct {
+    char magic[16];
+    addr_t csp0, pp0, vp0, rsp0;    ///< Layout of the RAM, which must match.
+    addr_t csp, pp, vp, rsp;        ///< End of the regions saved.
+    addr_t ip0, ip, data_next, on_error;
+    int err, trace, attr, num, status, chans;
+    unsigned seed;
+} ckpt_t;
+
+/// A file open at the checkpoint on channel ch: its name of len bytes follows.
+typedef struct {
+    int ch, mode, reclen, len;
+    off_t pos;
+    unsigned long bytes, lines;
+} ckpt_chan_t;
+
+/// Return the position to record for the file open on channel ch.
+off_t ckpt_pos(int ch) {
+    chan_t *c = rt.chan + ch;
+    if (c->wb != NULL) return lseek(c->wb->fd, 0, SEEK_CUR);
+    // Lines read ahead are counted in bytes when parsed.
+    if (c->ra != NULL) return c->bytes;
+    if (c->map != NULL || c->reclen > 0) return c->pos;
+    return ftello(c->file);
+}
+
+/** Write on the file name a checkpoint of the program, to be resumed from
+    rt.ip0 and IP: raise an error if it cannot be written. */
+void ckpt_write(const char *name) {
+    // Output files are flushed, and the size of the checkpoint computed.
+    size_t size = sizeof(ckpt_t) + (rt.csp - rt.csp0) + (rt.pp - rt.pp0)
+        + (rt.vp - rt.vp0) + (rt.rsp - rt.rsp0);
+    int chans = 0;
+    for (int i = 1; i < rt.chan_num; ++ i) {
+        if (rt.chan[i].file == NULL) continue;
+        if (rt.chan[i].pid > 0 || rt.chan[i].name == NULL) ERROR(CHECKPOINT);
+        if (rt.chan[i].wb != NULL) chan_flush(i);
+        size += sizeof(ckpt_chan_t) + strlen(rt.chan[i].name) + 1;
+        ++ chans;
+    }
+    char *buf = malloc(size), *p = buf;
+    if (buf == NULL) ERROR(CHECKPOINT);
+    // The numbers drawn after the checkpoint start from a saved seed.
+    ckpt_t h = {
+        CKPT_MAGIC, rt.csp0, rt.pp0, rt.vp0, rt.rsp0, rt.csp, rt.pp, rt.vp,
+        rt.rsp, rt.ip0, IP, rt.data_next, rt.on_error, rt.err, rt.trace,
+        rt.attr, rt.num, rt.status, chans, rt_rand()
+    };
+    rt_srand(h.seed);
+    memcpy(p, &h, sizeof(h)); p += sizeof(h);
+    memcpy(p, RAM + rt.csp0, rt.csp - rt.csp0); p += rt.csp - rt.csp0;
+    memcpy(p, RAM + rt.pp0, rt.pp - rt.pp0); p += rt.pp - rt.pp0;
+    memcpy(p, RAM + rt.vp0, rt.vp - rt.vp0); p += rt.vp - rt.vp0;
+    memcpy(p, RAM + rt.rsp0, rt.rsp - rt.rsp0); p += rt.rsp - rt.rsp0;
+    for (int i = 1; i < rt.chan_num; ++ i) {
+        if (rt.chan[i].file == NULL) continue;
+        ckpt_chan_t c = {
+            i, rt.chan[i].mode, rt.chan[i].reclen,
+            strlen(rt.chan[i].name) + 1, ckpt_pos(i)
+        };
+        chan_count(rt.chan + i, &c.bytes, &c.lines);
+        memcpy(p, &c, sizeof(c)); p += sizeof(c);
+        memcpy(p, rt.chan[i].name, c.len); p += c.len;
+    }
+    // The old checkpoint is replaced only by a complete new one.
+    char tmp[BUF_SIZE + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    int ok = fd >= 0 && write(fd, buf, size) == size;
+    if (fd >= 0) ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp, name) == 0;
+    free(buf);
+    if (!ok) {
+        unlink(tmp);
+        ERROR(WRITE);
+}}
+
+/** Write on the file name a checkpoint of the program, as ckpt_write does,
+    but return 0 or the error raised instead of raising it. */
+int ckpt_try(const char *name) {
+    jmp_buf error_saved;
+    int error = 0;
+    memcpy(error_saved, rt.err_buffer, sizeof(jmp_buf));
+    if (setjmp(rt.err_buffer) == 0) ckpt_write(name); else error = rt.error;
+    memcpy(rt.err_buffer, error_saved, sizeof(jmp_buf));
+    rt.error = 0;
+    return error;
+}
+
+/** Reopen on the channel c->ch the file name, as it was at the checkpoint:
+    raise an error if it cannot be opened. */
+void ckpt_reopen(const ckpt_chan_t *c, const char *name) {
+    int ch = chan_free(c->ch), ok;
+    if (c->mode == 1 || c->mode == 2) {
+        // What was written after the checkpoint is dropped.
+        int fd = open(name, O_WRONLY|O_CREAT|O_APPEND, 0666);
+        if (fd >= 0 && ftruncate(fd, c->pos) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        ok = fd >= 0 && chan_behind(ch, fd);
+        if (ok) {
+            rt.chan[ch].wb->bytes = c->bytes;
+            rt.chan[ch].wb->lines = c->lines;
+        }
+    } else if (c->mode == 4) {
+        ok = chan_open_binary(ch, name, c->reclen);
+        rt.chan[ch].pos = c->pos;
+    } else {
+        FILE *f = fopen(name, "r");
+        ok = f != NULL && fseeko(f, c->pos, SEEK_SET) == 0;
+        if (!ok) {
+            if (f != NULL) fclose(f);
+        } else if (c->mode == 3) {
+            ok = chan_ahead(ch, f);
+        } else {
+            rt.chan[ch].file = f;
+            chan_map(ch);
+            if (rt.chan[ch].map != NULL)
+                rt.chan[ch].pos = c->pos < rt.chan[ch].size ? c->pos : rt.chan[ch].size;
+    }}
+    if (!ok) ERROR(FILE);
+    if (rt.chan[ch].wb == NULL) {
+        rt.chan[ch].bytes = c->bytes;
+        rt.chan[ch].lines = c->lines;
+    }
+    rt.chan[ch].name = strdup(name);
+    rt.chan[ch].mode = c->mode;
+}
+
+/** Replace the program, its variables and its files with the checkpoint in
+    the file name, so that prog_continue resumes it: return 0, or the error
+    raised. */
+int ckpt_read(const char *name) {
+    char *volatile buf = NULL;
+    if (setjmp(rt.err_buffer)) {
+        free(buf);
+        return rt.error;
+    }
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) ERROR(FILE);
+    ssize_t n = -1;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL)
+        n = read(fd, buf, st.st_size);
+    close(fd);
+    ckpt_t h;
+    if (n < (ssize_t)sizeof(h) || n != st.st_size) ERROR(CHECKPOINT);
+    memcpy(&h, buf, sizeof(h));
+    const char *p = buf + sizeof(h), *end = buf + n;
+    // Regions must fit in the same layout of the RAM.
+    if (memcmp(h.magic, CKPT_MAGIC, sizeof(h.magic)) != 0
+    ||  h.csp0 != rt.csp0 || h.pp0 != rt.pp0 || h.vp0 != rt.vp0
+    ||  h.rsp0 != rt.rsp0 || h.csp < h.csp0 || h.csp > h.pp0
+    ||  h.pp < h.pp0 || h.pp > h.vp0 || h.vp < h.vp0 || h.vp > rt.sp0
+    ||  h.rsp < h.rsp0 || h.rsp > rt.obj
+    ||  end - p < (h.csp - h.csp0) + (h.pp - h.pp0) + (h.vp - h.vp0)
+            + (h.rsp - h.rsp0))
+        ERROR(CHECKPOINT);
+    rt_reset(RT_RESET_ALL);
+    memcpy(RAM + rt.csp0, p, h.csp - rt.csp0); p += h.csp - rt.csp0;
+    memcpy(RAM + rt.pp0, p, h.pp - rt.pp0); p += h.pp - rt.pp0;
+    memcpy(RAM + rt.vp0, p, h.vp - rt.vp0); p += h.vp - rt.vp0;
+    memcpy(RAM + rt.rsp0, p, h.rsp - rt.rsp0); p += h.rsp - rt.rsp0;
+    rt.tsp = rt.csp = h.csp;
+    rt.pp = h.pp;
+    rt.vp = h.vp;
+    rt.rsp = h.rsp;
+    rt.ip0 = h.ip0;
+    IP = h.ip;
+    rt.data_next = h.data_next;
+    rt.on_error = h.on_error;
+    rt.err = h.err;
+    rt.trace = h.trace;
+    rt.attr = h.attr;
+    rt.num = h.num;
+    rt.status = h.status;
+    rt_srand(h.seed);
+    for (int i = 0; i < h.chans; ++ i) {
+        ckpt_chan_t c;
+        if (end - p < (ssize_t)sizeof(c)) ERROR(CHECKPOINT);
+        memcpy(&c, p, sizeof(c)); p += sizeof(c);
+        if (c.len < 1 || end - p < c.len || p[c.len - 1] != 0)
+            ERROR(CHECKPOINT);
+        ckpt_reopen(&c, p);
+        p += c.len;
+    }
+    free(buf);
+    return 0;
+}
+
+/// \}
+/** \defgroup SB Library Interface
+
+    The functions declared in libstraybasic.h, which let a host program create
+    any number of interpreters, each one with its own rt, and drive them: each
+    function makes its interpreter the current one, and returns the code of
+    the error raised inside it, if any. */
+/// \{
+
+#include "libstraybasic.h"
+
+/// Make sb the current rt, and return from the caller the errors raised.
+#define SB_ENTER(sb) rt_current = (sb); if (setjmp(rt.err_buffer)) return rt.error
+
+sb_t *sb_new(void) {
+    sb_t *sb = rt_new();
+    if (sb != NULL) {
+        rt.hosted = 1;
+        rt.batch = 1;
+    }
+    return sb;
+}
+
+/// Close the streams opened by sb_io, if any, going back to the standard ones.
+void sb_close_io(void) {
+    if (rt.in != stdin) fclose(rt.in);
+    if (rt.out != stdout) fclose(rt.out);
+    rt.in = rt.chan[0].file = stdin;
+    rt.out = stdout;
+    rt.msg = stderr;
+}
+
+void sb_free(sb_t *sb) {
+    if (sb == NULL) return;
+    rt_current = sb;
+    rt_reset(RT_RESET_FILES);
+    sb_close_io();
+    par_free(rt.par);
+    rt_release();
+    free(rt.screen[0]);
+    free(rt.screen[1]);
+    free(rt.chan);
+    free(sb);
+    rt_current = NULL;
+}
+
+int sb_io(sb_t *sb, sb_read_t *read, sb_write_t *write, void *user) {
+    rt_current = sb;
+    sb_close_io();
+    FILE *in = fopencookie(user, "r", (cookie_io_functions_t){ .read = read });
+    FILE *out = fopencookie(user, "w", (cookie_io_functions_t){ .write = write });
+    if (in == NULL || out == NULL) {
+        if (in != NULL) fclose(in);
+        if (out != NULL) fclose(out);
+        return ERROR_FILE;
+    }
+    rt.in = rt.chan[0].file = in;
+    rt.out = rt.msg = out;
+    return 0;
+}
+
+int sb_load(sb_t *sb, const char *source) {
+    SB_ENTER(sb);
+    rt_reset(RT_RESET_ALL);
+    FILE *f = fmemopen((char*)source, strlen(source), "r");
+    if (f == NULL) ERROR(FILE);
+    prog_repl(f);
+    fclose(f);
+    rt.prog_changed = 0;
+    fflush(rt.out);
+    return rt.error;
+}
+
+int sb_run(sb_t *sb, long budget) {
+    SB_ENTER(sb);
+    // As RUN, but the variables set by the host are kept.
+    addr_t vp = rt.vp;
+    rt_reset(RT_RESET_VARS);
+    rt.vp = vp;
+    rt.budget = budget;
+    rt.fault = 0;
+    prog_exec();
+    rt.budget = 0;
+    fflush(rt.out);
+    return rt.fault;
+}
+
+/** Return the address of the scalar variable named name, in any case, or NIL
+    if it does not exist: if create != 0, it is created instead. */
+addr_t sb_var(const char *name, int create) {
+    char buf[BUF_SIZE];
+    int len = 0;
+    while (name[len] != '\0') {
+        if (len == BUF_SIZE - 1 || !(len == 0 ? isalpha(name[len])
+            : isalnum(name[len]) || (name[len] == '$' && name[len + 1] == '\0')))
+            ERROR(IDENTIFIER);
+        buf[len] = toupper(name[len]);
+        ++ len;
+    }
+    if (len == 0) ERROR(IDENTIFIER);
+    int s = cstr_find(buf, len);
+    if (s < 0 && create && (s = cstr_add(buf, len)) < 0) ERROR(OUT_OF_STRINGS);
+    addr_t v = s < 0 ? NIL : var_find(s);
+    if (v == NIL && create) {
+        v = rt.vp;
+        var_create(s, buf[len - 1] == '$' ? VAR_STR : VAR_NUM, 0, 0, 0, 0, 0);
+    }
+    return v;
+}
+
+int sb_get_num(sb_t *sb, const char *name, double *x) {
+    SB_ENTER(sb);
+    addr_t v = sb_var(name, 0);
+    if (v == NIL) ERROR(UNDEFINED_VARIABLE);
+    if (VAR_TYPE(v) != VAR_NUM && VAR_TYPE(v) != VAR_FOR) ERROR(NUMVAR);
+    *x = PEEK_NUM(VAR_ADDR(v));
+    return 0;
+}
+
+int sb_set_num(sb_t *sb, const char *name, double x) {
+    SB_ENTER(sb);
+    addr_t v = sb_var(name, 1);
+    if (VAR_TYPE(v) != VAR_NUM && VAR_TYPE(v) != VAR_FOR) ERROR(NUMVAR);
+    POKE_NUM(VAR_ADDR(v), x);
+    return 0;
+}
+
+int sb_get_str(sb_t *sb, const char *name, const char **s) {
+    SB_ENTER(sb);
+    addr_t v = sb_var(name, 0);
+    if (v == NIL) ERROR(UNDEFINED_VARIABLE);
+    if (VAR_TYPE(v) != VAR_STR) ERROR(STRVAR);
+    *s = (const char*)RAM + VAR_ADDR(v);
+    return 0;
+}
+
+int sb_set_str(sb_t *sb, const char *name, const char *s) {
+    SB_ENTER(sb);
+    addr_t v = sb_var(name, 1);
+    if (VAR_TYPE(v) != VAR_STR) ERROR(STRVAR);
+    assign_chars(v, VAR_ADDR(v), s, strlen(s));
+    return 0;
+}
+
+const char *sb_message(int error) {
+    return error >= 0 && error < sizeof(Errors)/sizeof(*Errors) ? Errors[error]
+        : NULL;
+}
+
+/// \}
+#ifndef SB_LIBRARY
+/** \defgroup SERVE Job Server
+
+    With "-s socket file.bas ..." the interpreter loads the programs once and
+    then serves jobs on the Unix socket: a job is a connection which sends
+    the name of one of the programs, without its path, on the first line,
+    followed by the input of the program, and receives what it prints. Jobs
+    are served by SERVE_POOL children forked in advance, each one running a
+    single job on its copy of the programs, while the server forks another
+    one: thus a job pays neither the launch of the interpreter nor the
+    loading of its program, and jobs cannot affect each other. A job is
+    stopped after SERVE_BUDGET statements, and its child is killed after
+    SERVE_TIME seconds, so that runaway jobs cannot exhaust the pool. When
+    the job ends, a NUL byte, which a program cannot print on channel #0, is
+    sent followed by the exit status of the job.
+
+    "-c socket name" is a client, which sends its standard input to the job
+    and prints its output, while "-l socket name jobs clients" is a load
+    test, which runs the jobs by as many clients at the same time, printing
+    their throughput and latency: if socket is "-" each job launches the
+    interpreter on the file name instead, for comparison. */
+/// \{
+
+/// Connect to the Unix socket path: return the connection, or -1.
+int serve_connect(const char *path) {
+    struct sockaddr_un a = { .sun_family = AF_UNIX };
+    strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&a, sizeof(a)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/// Write the n bytes at b on fd: return 0, or -1 if they cannot be written.
+int serve_write(int fd, const char *b, ssize_t n) {
+    for (ssize_t k; n > 0; b += k, n -= k)
+        if ((k = write(fd, b, n)) <= 0) return -1;
+    return 0;
+}
+
+/// Connection of the job served by a child of the server.
+static FILE *serve_out;
+
+/** At the exit of a child of the server, send to its client a NUL followed by
+    the exit status of the job: it failed if an error other than STOP ended
+    it, which is also the case if the job could not start. */
+void serve_end(void) {
+    int failed = rt.fault != 0 && rt.fault != ERROR_STOP;
+    fputc('\0', serve_out);
+    fputc(failed ? EXIT_FAILURE : EXIT_SUCCESS, serve_out);
+    fflush(serve_out);
+}
+
+/** In a child of the server, serve a job on the connection fd by one of the
+    n programs loaded into progs, whose names are in names, and exit. */
+void serve_job(int fd, int n, struct runtime **progs, char **names) {
+    FILE *in = fdopen(fd, "r"), *out = fdopen(dup(fd), "w");
+    char name[BUF_SIZE];
+    if (in == NULL || out == NULL) exit(EXIT_FAILURE);
+    serve_out = out;
+    atexit(serve_end);
+    rt.fault = ERROR_FILE;
+    if (fgets(name, sizeof(name), in) == NULL) exit(EXIT_FAILURE);
+    name[strcspn(name, "\r\n")] = '\0';
+    int i = 0;
+    while (i < n && strcmp(names[i], name) != 0) ++ i;
+    if (i == n) {
+        fprintf(out, "%s\n", Errors[ERROR_FILE]);
+        exit(EXIT_FAILURE);
+    }
+    rt_current = progs[i];
+    rt.in = rt.chan[0].file = in;
+    rt.out = rt.msg = out;
+    rt.batch = 1;
+    rt.budget = SERVE_BUDGET;
+    rt.fault = 0;
+    INSTR_RUN();
+    exit(EXIT_SUCCESS);
+}
+
+/** Load the n programs in files and serve their jobs on the Unix socket path:
+    return only if the server cannot start. */
+int serve(const char *path, int n, char **files) {
+    struct runtime **progs = calloc(n, sizeof(struct runtime*));
+    char **names = calloc(n, sizeof(char*));
+    if (progs == NULL || names == NULL) return EXIT_FAILURE;
+    for (int i = 0; i < n; ++ i) {
+        if ((progs[i] = rt_new()) == NULL) return EXIT_FAILURE;
+        if (prog_load(files[i])) {
+            fprintf(stderr, "%s: %s\n", files[i], Errors[rt.error]);
+            return EXIT_FAILURE;
+        }
+        char *slash = strrchr(files[i], '/');
+        names[i] = slash != NULL ? slash + 1 : files[i];
+    }
+    struct sockaddr_un a = { .sun_family = AF_UNIX };
+    strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&a, sizeof(a)) != 0
+    ||  listen(fd, SOMAXCONN) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, SIG_DFL);
+    for (int children = 0; ; ) {
+        while (children < SERVE_POOL) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                // The child waits for a job, and ends with the server. If
+                // accept fails for good, it exits and the server reforks.
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                int c;
+                while ((c = accept(fd, NULL, NULL)) < 0)
+                    if (errno != EINTR && errno != ECONNABORTED)
+                        _exit(EXIT_FAILURE);
+                close(fd);
+                alarm(SERVE_TIME);
+                serve_job(c, n, progs, names);
+            }
+            if (pid < 0) { sleep(1); break; }
+            ++ children;
+        }
+        if (wait(NULL) > 0) -- children;
+}}
+
+/** Pass the n bytes at b, received from a job, to the file descriptor out,
+    if >= 0, up to the NUL which ends the output: *status is -1 before it,
+    -2 after it, and then the exit status of the job, which follows it. */
+void serve_output(const char *b, ssize_t n, int out, int *status) {
+    if (*status == -1) {
+        const char *nul = memchr(b, '\0', n);
+        ssize_t k = nul != NULL ? nul - b : n;
+        if (out >= 0) serve_write(out, b, k);
+        if (nul == NULL) return;
+        *status = -2;
+        b += k + 1;
+        n -= k + 1;
+    }
+    if (*status == -2 && n > 0) *status = (byte_t)*b;
+}
+
+/** Run a job of the program name on the server at path, sending it the
+    standard input and printing its output: return the exit status of the
+    job, which is a failure if it did not end normally. */
+int serve_client(const char *path, const char *name) {
+    int fd = serve_connect(path);
+    if (fd < 0) { perror(path); return EXIT_FAILURE; }
+    // A job may end without reading its input.
+    signal(SIGPIPE, SIG_IGN);
+    dprintf(fd, "%s\n", name);
+    struct pollfd p[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+    char b[BUF_SIZE];
+    int status = -1;
+    while (poll(p, 2, -1) > 0) {
+        ssize_t k;
+        if (p[0].revents != 0) {
+            // The end of the input is sent as the end of the connection.
+            k = read(STDIN_FILENO, b, sizeof(b));
+            if (k <= 0 || serve_write(fd, b, k) != 0) {
+                shutdown(fd, SHUT_WR);
+                p[0].fd = -1;
+            }
+        }
+        if (p[1].revents != 0) {
+            if ((k = read(fd, b, sizeof(b))) <= 0) break;
+            serve_output(b, k, STDOUT_FILENO, &status);
+    }}
+    close(fd);
+    return status == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/// Return the time in seconds from an arbitrary origin.
+double serve_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/** Run a job of the program name with no input, on the server at path or, if
+    path is "-", by launching the interpreter on the file name, discarding
+    its output: return 0, or -1 if the job could not be run or failed. */
+int serve_run(const char *path, const char *name) {
+    if (strcmp(path, "-") == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null = open("/dev/null", O_RDWR);
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            execl("/proc/self/exe", "straybasic", "-b", name, (char*)NULL);
+            _exit(EXIT_FAILURE);
+        }
+        int status;
+        return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status)
+            && WEXITSTATUS(status) == EXIT_SUCCESS ? 0 : -1;
+    }
+    int fd = serve_connect(path);
+    if (fd < 0) return -1;
+    char b[BUF_SIZE];
+    int ok = dprintf(fd, "%s\n", name) > 0 && shutdown(fd, SHUT_WR) == 0;
+    int status = -1;
+    for (ssize_t k; ok && (k = read(fd, b, sizeof(b))) > 0; )
+        serve_output(b, k, -1, &status);
+    close(fd);
+    return ok && status == EXIT_SUCCESS ? 0 : -1;
+}
+
+/// A client of the load test, running jobs jobs whose latencies go to lat.
+typedef struct {
+    const char *path, *name;
+    long jobs, failed;
+    double *lat;
+} load_t;
+
+/// Thread of a client of the load test.
+void *serve_load_client(void *arg) {
+    load_t *l = arg;
+    // Signals are for the main thread, whose rt their handlers use.
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    for (long i = 0; i < l->jobs; ++ i) {
+        double t = serve_clock();
+        if (serve_run(l->path, l->name) != 0) ++ l->failed;
+        l->lat[i] = serve_clock() - t;
+    }
+    return NULL;
+}
+
+/// Compare two latencies, for qsort.
+int serve_cmp(const void *x, const void *y) {
+    double a = *(const double*)x, b = *(const double*)y;
+    return (a > b) - (a < b);
+}
+
+/** Run jobs jobs of the program name by clients clients at the same time, on
+    the server at path (see serve_run), and print throughput and latency. */
+int serve_load(const char *path, const char *name, long jobs, int clients) {
+    if (jobs < 1 || clients < 1) return EXIT_FAILURE;
+    if (clients > jobs) clients = jobs;
+    signal(SIGPIPE, SIG_IGN);
+    double *lat = malloc(jobs * sizeof(double));
+    load_t *l = calloc(clients, sizeof(load_t));
+    pthread_t *t = calloc(clients, sizeof(pthread_t));
+    if (lat == NULL || l == NULL || t == NULL) return EXIT_FAILURE;
+    double t0 = serve_clock();
+    for (long i = 0, k = 0; i < clients; k += l[i ++].jobs) {
+        l[i] = (load_t){ path, name, jobs / clients + (i < jobs % clients), 0, lat + k };
+        if (pthread_create(t + i, NULL, serve_load_client, l + i) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+    }}
+    long failed = 0;
+    for (int i = 0; i < clients; ++ i) {
+        pthread_join(t[i], NULL);
+        failed += l[i].failed;
+    }
+    double secs = serve_clock() - t0, sum = 0;
+    qsort(lat, jobs, sizeof(double), serve_cmp);
+    for (long i = 0; i < jobs; ++ i) sum += lat[i];
+    printf("%ld JOBS BY %i CLIENTS IN %.3f SECONDS: %.1f JOBS/S, %ld FAILED\n",
+        jobs, clients, secs, jobs / secs, failed);
+    printf("LATENCY (MS): MEAN %.3f, MEDIAN %.3f, 99%% %.3f, MAX %.3f\n",
+        1e3 * sum / jobs, 1e3 * lat[jobs / 2], 1e3 * lat[jobs * 99 / 100],
+        1e3 * lat[jobs - 1]);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /// \}
@@ -2309,15 +6466,48 @@ int fn_eval(str_t name) {
 /// \{
 
 int main(int npar, char **pars) {
-    rt_init();
+    if (rt_new() == NULL) return EXIT_FAILURE;
+    signal(SIGWINCH, term_size);
+    signal(SIGINT, rt_ctrlbreak);
+    signal(SIGUSR1, rt_checkpoint);
+    atexit(chan_flush_all);
+    if (npar > 3 && strcmp(pars[1], "-s") == 0)
+        return serve(pars[2], npar - 3, pars + 3);
+    if (npar == 4 && strcmp(pars[1], "-c") == 0)
+        return serve_client(pars[2], pars[3]);
+    if (npar == 6 && strcmp(pars[1], "-l") == 0)
+        return serve_load(pars[2], pars[3], atol(pars[4]), atoi(pars[5]));
+    // Batch mode is forced by -b, else it is chosen if stdout is redirected.
+    rt.batch = !isatty(STDOUT_FILENO);
+    if (npar > 1 && strcmp(pars[1], "-b") == 0) {
+        rt.batch = 1;
+        -- npar;
+        ++ pars;
+    }
+    // A checkpoint is resumed as a program would be run.
+    const char *resume = NULL;
+    if (npar == 3 && strcmp(pars[1], "--resume") == 0) {
+        resume = pars[2];
+        npar = 1;
+    }
     if (npar > 2) {
-        puts("USAGE: straybasic [file.bas]");
+        puts("USAGE: straybasic [-b] [file.bas]");
+        puts("       straybasic [-b] --resume file.ckp");
+        puts("       straybasic -s socket file.bas ...");
+        puts("       straybasic -c socket name");
+        puts("       straybasic -l socket|- file.bas jobs clients");
         return EXIT_FAILURE;
     }
-    // green foreground, black background.
-    fputs("\033[38;2;0;255;0m\033[48;2;0;0;0m", stdout);
-    fputs("\033[2J\033[1;1f", stdout);   // cls, home.
-    if (npar == 1) {
+    if (rt.batch) {
+        setvbuf(stdout, NULL, _IOFBF, OUT_BUF_SIZE);
+    } else {
+        // green foreground, black background.
+        fputs("\033[38;2;0;255;0m\033[48;2;0;0;0m", stdout);
+        fputs("\033[2J\033[1;1f", stdout);   // cls, home.
+    }
+    if (resume != NULL) {
+        if (ckpt_read(resume)) puts(Errors[rt.error]); else prog_continue();
+    } else if (npar == 1) {
         puts("//== ====== ||==\\    =  \\\\  // ||==\\    =    //== ||  //=\\");
         puts("\\\\     ||   ||__/   / \\  \\\\//  ||__/   / \\   \\\\   || ||");
         puts("  \\\\   ||   ||\\\\   //_\\\\  ||   ||  \\  //_\\\\    \\\\ || ||");
@@ -2339,3 +6529,4 @@ int main(int npar, char **pars) {
 }
 
 /// \}
+#endif
@@ -66,11 +66,26 @@ E(VALUE, "VALUE EXPECTED")
 E(UNDEFINED_VARIABLE, "UNDEFINED VARIABLE")
 E(VARIABLE_ALREADY_DEFINED, "VARIABLE ALREADY DEFINED")
 E(ZERO, "DIVISION BY ZERO")
+//  Further errors are appended, so that the codes above do not change.
+E(WRITE, "WRITE ERROR")
+E(ARRAY, "ARRAY EXPECTED")
+E(RECORD, "RECORD TOO LONG")
+E(DIMENSION, "DIMENSION MISMATCH")
+E(MAP, "MAP EXPECTED")
+E(KEY, "ILLEGAL KEY")
+E(PATTERN, "ILLEGAL PATTERN")
+E(FNEND, "FNEND EXPECTED")
+E(TOO_MANY_CALLS, "TOO MANY NESTED CALLS")
+E(PURE, "ILLEGAL PURE FUNCTION")
+E(PARALLEL, "JUMP OUT OF PARALLEL FOR")
+E(BUDGET, "STATEMENT BUDGET EXHAUSTED")
+E(CHECKPOINT, "ILLEGAL CHECKPOINT")
 
 //  Instructions: I(label)
 I(ATTR)
 I(BYE)
 I(CHAIN)
+I(CHECKPOINT)
 I(CLEAR)
 I(CLOSE)
 I(CLS)
@@ -80,7 +95,10 @@ I(DIM)
 I(DUMP)
 I(END)
 I(ERROR)
+I(FLUSH)
+I(FNEND)
 I(FOR)
+I(GET)
 I(GOSUB)
 I(GOTO)
 I(IF)
@@ -89,14 +107,18 @@ I(LET)
 I(LINPUT)
 I(LIST)
 I(LOAD)
+I(LOCAL)
+I(MAT)
 I(MERGE)
 I(NEW)
 I(NEXT)
 I(ON)
 I(OPEN)
 I(PRINT)
+I(PUT)
 I(RANDOMIZE)
 I(READ)
+I(REFRESH)
 I(REM)
 I(REPEAT)
 I(RESTORE)
@@ -104,6 +126,7 @@ I(RETURN)
 I(RUN)
 I(SAVE)
 I(SKIP)
+I(SORT)
 I(STEP)
 I(STOP)
 I(SYS)
@@ -135,30 +158,50 @@ O("CHR$", CHRS, 1, 0, 100)
 O("COL", COL, 0, 0, 100)
 O("COS", COS, 1, 0, 100)
 O("DIV", IDIV, 2, 0, 100)
+O("DOT", DOT, ARRAY_ARGS, 0, 100)
 O("EOF", EOF, 1, 0, 100)
 O("ERR", ERR, 0, 0, 100)
 O("EXP", EXP, 1, 0, 100)
 O("INKEY", INKEY, 0, 0, 100)
 O("INKEY$", INKEYS, 0, 0, 100)
+O("INSTR", INSTR, 3, 0, 100)
+O("INSTRI", INSTRI, 3, 0, 100)
 O("INT", INT, 1, 0, 100)
 O("LEFT$", LEFTS, 2, 0, 100)
 O("LEN", LEN, 1, 0, 100)
+O("LOF", LOF, 1, 0, 100)
 O("LOG", LOG, 1, 0, 100)
+O("LOWER$", LOWERS, 1, 0, 100)
+O("MATCH", MATCH, 2, 0, 100)
+O("MATCH$", MATCHS, 2, 0, 100)
+O("MAX", MAX, ARRAY_ARGS, 0, 100)
+O("MEAN", MEAN, ARRAY_ARGS, 0, 100)
 O("MID$", MIDS, 3, 0, 100)
+O("MIN", MIN, ARRAY_ARGS, 0, 100)
 O("MOD", MOD, 2, 0, 100)
+O("NEXTKEY$", NEXTKEYS, ARRAY_ARGS, 0, 100)
 O("NOT", NOT, 1, 0, 20)
+O("NUM", NUM, 0, 0, 100)
 O("OR", OR, 2, 1, 10)
+O("REPLACE$", REPLACES, 3, 0, 100)
 O("RIGHT$", RIGHTS, 2, 0, 100)
 O("RND", RND, 0, 0, 100)
 O("ROW", ROW, 0, 0, 100)
+O("SEEK", SEEK, 1, 0, 100)
 O("SGN", SGN, 1, 0, 100)
 O("SIN", SIN, 1, 0, 100)
+O("SPACE$", SPACES, 1, 0, 100)
 O("SQR", SQR, 1, 0, 100)
+O("STATUS", STATUS, 0, 0, 100)
 O("STR$", STRS, 1, 0, 100)
+O("STRING$", STRINGS, 2, 0, 100)
 O("SUB$", SUBS, 3, 0, 100)
+O("SUM", SUM, ARRAY_ARGS, 0, 100)
 O("TAB", TAB, 1, 0, 100)
 O("TAN", TAN, 1, 0, 100)
 O("TIME", TIME, 0, 0, 100)
+O("TRIM$", TRIMS, 1, 0, 100)
+O("UPPER$", UPPERS, 1, 0, 100)
 O("VAL", VAL, 1, 0, 100)
 O("^", POW, 2, 1, 80)
 